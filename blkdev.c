@@ -0,0 +1,690 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "fs.h"
+#include "blkdev.h"
+
+#define TOTAL_BLOCKS (FSSIZE / BLKSIZE)
+
+unsigned char* fs;
+
+const struct blkdev * blkdev = NULL;
+
+/* Buffer for count blocks, aligned for any backend */
+void * blkdev_alloc(unsigned int count){
+  void * buf = NULL;
+  const int err = posix_memalign(&buf, BLKDEV_ALIGN, (size_t) count * BLKSIZE);
+  if(err != 0){
+    errno = err;
+    return NULL;
+  }
+  return buf;
+}
+
+/* mmap backend, the image is mapped whole */
+
+static void * mmap_ref(unsigned int n){ return &fs[BLKSIZE * n]; }
+
+static const void * mmap_read(unsigned int n, void * buf){ return &fs[BLKSIZE * n]; }
+
+static int mmap_read_many(const unsigned int * blocks, unsigned int count, void * buf){
+  unsigned int i;
+  for(i=0; i < count; i++){
+    memcpy((unsigned char *) buf + BLKSIZE * i, &fs[BLKSIZE * blocks[i]], BLKSIZE);
+  }
+  return 0;
+}
+
+static int mmap_write_many(const unsigned int * blocks, unsigned int count, const void * buf){
+  unsigned int i;
+  for(i=0; i < count; i++){
+    memcpy(&fs[BLKSIZE * blocks[i]], (const unsigned char *) buf + BLKSIZE * i, BLKSIZE);
+  }
+  return 0;
+}
+
+static void mmap_pin(unsigned int count){ }
+
+static void mmap_advise(unsigned int first, unsigned int count, int advice){
+  static const int madv[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_WILLNEED};
+  const unsigned long page  = sysconf(_SC_PAGESIZE);
+  const unsigned long start = ((unsigned long) first * BLKSIZE) & ~(page - 1);
+  const unsigned long end   = (unsigned long) (first + count) * BLKSIZE;
+
+  madvise(&fs[start], end - start, madv[advice]);
+}
+
+static void mmap_zero(){ bzero(fs, FSSIZE); }
+
+static void mmap_release(){ }
+
+static void mmap_sync(){ }
+
+static void mmap_close(){ munmap(fs, FSSIZE); }
+
+static const struct blkdev mmap_dev = {
+  64, mmap_ref, mmap_read, mmap_read_many, mmap_write_many, mmap_pin, mmap_advise, mmap_zero, mmap_release, mmap_sync, mmap_close
+};
+
+static void mmap_open(int fd, int hints){
+  const int flags = MAP_SHARED | ((hints & MAP_HINT_POPULATE) ? MAP_POPULATE : 0);
+
+  if(hints & MAP_HINT_DIRECT){
+    fprintf(stderr, "Error: O_DIRECT needs the pread or uring backend\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((fs = mmap(NULL, FSSIZE, PROT_READ | PROT_WRITE, flags, fd, 0)) == MAP_FAILED){
+      perror("mmap failed");
+      exit(EXIT_FAILURE);
+  }
+
+  /* a hint only, not all filesystems can back a mapping with huge pages */
+  if(hints & MAP_HINT_HUGEPAGE){
+    madvise(fs, FSSIZE, MADV_HUGEPAGE);
+  }
+  blkdev = &mmap_dev;
+}
+
+/* pread backend, blocks are read into a buffer cache and written back on sync */
+
+#define CACHE_SLOTS    1024  /* blocks kept cached between operations */
+#define WRITEBACK_IOVS 64    /* blocks merged into one write */
+
+struct slot {  // cached block
+  unsigned char data[BLKSIZE];   //first, to keep it aligned
+  unsigned char clean[BLKSIZE];  //data as read, to find modified blocks
+  unsigned int  block;
+  unsigned char ref;             //used since the clock hand last passed
+  unsigned char busy;            //used since last release, can't be evicted
+};
+
+static int              dev_fd       = -1;
+static int              dev_direct   = 0;     //opened with O_DIRECT, page cache unused
+static unsigned char  * pinned       = NULL;  //resident blocks [0, pinned_count)
+static unsigned char  * pinned_clean = NULL;
+static unsigned int     pinned_count = 0;
+static struct slot   ** slots        = NULL;
+static unsigned int     slot_count   = 0;
+static int              slot_of[TOTAL_BLOCKS];  //slot of each block, or -1
+static unsigned int     clock_hand   = 0;
+static pthread_mutex_t  cache_lock   = PTHREAD_MUTEX_INITIALIZER;
+
+/* Read blocks from device, exit on failure as there is no one to tell */
+static void dev_read(unsigned int first, unsigned int count, void * buf){
+  const ssize_t n = pread(dev_fd, buf, (size_t) count * BLKSIZE, (off_t) first * BLKSIZE);
+  if(n != (ssize_t) count * BLKSIZE){
+    perror("pread");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Write blocks to device */
+static int dev_write(unsigned int first, unsigned int count, const void * buf){
+  const ssize_t n = pwrite(dev_fd, buf, (size_t) count * BLKSIZE, (off_t) first * BLKSIZE);
+  if(n != (ssize_t) count * BLKSIZE){
+    perror("pwrite");
+    return -1;
+  }
+  return 0;
+}
+
+/* Drop every cached block, without writing it */
+static void cache_drop(){
+  unsigned int i;
+  for(i=0; i < slot_count; i++){
+    slot_of[slots[i]->block] = -1;
+    free(slots[i]);
+  }
+  free(slots);
+  slots = NULL;
+  slot_count = 0;
+  clock_hand = 0;
+}
+
+/* Block was modified since it was read */
+static int slot_dirty(const struct slot * slot_ptr){
+  return memcmp(slot_ptr->data, slot_ptr->clean, BLKSIZE) != 0;
+}
+
+/* Order slots by block number */
+static int slot_cmp(const void * a, const void * b){
+  const struct slot * sa = *(struct slot * const *) a;
+  const struct slot * sb = *(struct slot * const *) b;
+  return (sa->block > sb->block) - (sa->block < sb->block);
+}
+
+/* Write back dirty slots in block order, merging neighbours into one write */
+static void cache_writeback(struct slot ** list, unsigned int count){
+  unsigned int i, j, n;
+  struct iovec iov[WRITEBACK_IOVS];
+
+  qsort(list, count, sizeof(struct slot *), slot_cmp);
+
+  for(i=0; i < count; i += n){
+    for(n=0; (i + n < count) && (n < WRITEBACK_IOVS) && (list[i + n]->block == list[i]->block + n); n++){
+      iov[n].iov_base = list[i + n]->data;
+      iov[n].iov_len  = BLKSIZE;
+    }
+
+    if(pwritev(dev_fd, iov, n, (off_t) list[i]->block * BLKSIZE) != (ssize_t) n * BLKSIZE){
+      perror("pwritev");
+      continue;
+    }
+    for(j=0; j < n; j++){
+      memcpy(list[i + j]->clean, list[i + j]->data, BLKSIZE);
+    }
+  }
+}
+
+/* Pick a slot to reuse with CLOCK, busy slots are skipped. Returns -1 if none */
+static int cache_victim(){
+  unsigned int step;
+
+  for(step=0; step < 2 * slot_count; step++){
+    const unsigned int i = clock_hand;
+    struct slot * slot_ptr = slots[i];
+
+    clock_hand = (clock_hand + 1) % slot_count;
+    if(slot_ptr->busy){
+      continue;
+    }
+    if(slot_ptr->ref){
+      slot_ptr->ref = 0;  //second chance
+      continue;
+    }
+    return i;
+  }
+  return -1;
+}
+
+/* Get cache slot of a block, reading it if needed. Call with cache_lock held */
+static struct slot * cache_get(unsigned int n){
+  struct slot * slot_ptr;
+
+  if(slot_of[n] >= 0){
+    slot_ptr = slots[slot_of[n]];
+    slot_ptr->ref = slot_ptr->busy = 1;
+    return slot_ptr;
+  }
+
+  /* reuse a slot once the cache is full, grow it if all are busy */
+  int i = (slot_count >= CACHE_SLOTS) ? cache_victim() : -1;
+  if(i >= 0){
+    slot_ptr = slots[i];
+    if(slot_dirty(slot_ptr)){
+      cache_writeback(&slot_ptr, 1);
+    }
+    slot_of[slot_ptr->block] = -1;
+  }else{
+    struct slot ** grown = realloc(slots, (slot_count + 1) * sizeof(struct slot *));
+    if((grown == NULL) || (posix_memalign((void **) &slot_ptr, BLKDEV_ALIGN, sizeof(struct slot)) != 0)){
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    slots = grown;
+    i = slot_count++;
+    slots[i] = slot_ptr;
+  }
+
+  dev_read(n, 1, slot_ptr->data);
+  memcpy(slot_ptr->clean, slot_ptr->data, BLKSIZE);
+  slot_ptr->block = n;
+  slot_ptr->ref = slot_ptr->busy = 1;
+
+  slot_of[n] = i;
+  return slot_ptr;
+}
+
+static void * pread_ref(unsigned int n){
+  if(n < pinned_count){
+    return &pinned[BLKSIZE * n];
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  struct slot * slot_ptr = cache_get(n);
+  pthread_mutex_unlock(&cache_lock);
+  return slot_ptr->data;
+}
+
+static const void * pread_read(unsigned int n, void * buf){
+  if(n < pinned_count){
+    return &pinned[BLKSIZE * n];
+  }
+
+  /* cached copy may be newer than the device, it is copied while held
+     since the slot can be evicted as soon as the lock is dropped */
+  pthread_mutex_lock(&cache_lock);
+  const int cached = (slot_of[n] >= 0);
+  if(cached){
+    memcpy(buf, slots[slot_of[n]]->data, BLKSIZE);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if(cached){
+    return buf;
+  }
+
+  if(pread(dev_fd, buf, BLKSIZE, (off_t) n * BLKSIZE) != BLKSIZE){
+    perror("pread");
+    return NULL;
+  }
+  return buf;
+}
+
+/* Replace blocks just read with their cached copies, which may be newer */
+static void cache_overlay(const unsigned int * blocks, unsigned int count, unsigned char * buf){
+  unsigned int i;
+
+  pthread_mutex_lock(&cache_lock);
+  for(i=0; i < count; i++){
+    if(blocks[i] < pinned_count){
+      memcpy(&buf[BLKSIZE * i], &pinned[BLKSIZE * blocks[i]], BLKSIZE);
+    }else if(slot_of[blocks[i]] >= 0){
+      memcpy(&buf[BLKSIZE * i], slots[slot_of[blocks[i]]]->data, BLKSIZE);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* Keep cached copies of blocks just written in step */
+static void cache_update(const unsigned int * blocks, unsigned int count, const unsigned char * buf){
+  unsigned int i;
+
+  pthread_mutex_lock(&cache_lock);
+  for(i=0; i < count; i++){
+    if(blocks[i] < pinned_count){
+      memcpy(&pinned[BLKSIZE * blocks[i]],       &buf[BLKSIZE * i], BLKSIZE);
+      memcpy(&pinned_clean[BLKSIZE * blocks[i]], &buf[BLKSIZE * i], BLKSIZE);
+    }else if(slot_of[blocks[i]] >= 0){
+      memcpy(slots[slot_of[blocks[i]]]->data,  &buf[BLKSIZE * i], BLKSIZE);
+      memcpy(slots[slot_of[blocks[i]]]->clean, &buf[BLKSIZE * i], BLKSIZE);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* Number of blocks that follow each other on device, starting at blocks[0] */
+static unsigned int run_length(const unsigned int * blocks, unsigned int count){
+  unsigned int n = 1;
+  while((n < count) && (blocks[n] == blocks[0] + n)){
+    n++;
+  }
+  return n;
+}
+
+static int pread_read_many(const unsigned int * blocks, unsigned int count, void * buf){
+  unsigned int i, n;
+  unsigned char * p = buf;
+
+  for(i=0; i < count; i += n){
+    n = run_length(&blocks[i], count - i);
+    const ssize_t len = (ssize_t) n * BLKSIZE;
+    if(pread(dev_fd, &p[BLKSIZE * i], len, (off_t) blocks[i] * BLKSIZE) != len){
+      perror("pread");
+      return -1;
+    }
+  }
+  cache_overlay(blocks, count, buf);
+  return 0;
+}
+
+static int pread_write_many(const unsigned int * blocks, unsigned int count, const void * buf){
+  unsigned int i, n;
+  const unsigned char * p = buf;
+
+  cache_update(blocks, count, buf);
+  for(i=0; i < count; i += n){
+    n = run_length(&blocks[i], count - i);
+    if(dev_write(blocks[i], n, &p[BLKSIZE * i]) == -1){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void pread_pin(unsigned int count){
+  unsigned int n;
+
+  if(count <= pinned_count){
+    return;
+  }
+
+  unsigned char * grown       = blkdev_alloc(count);
+  unsigned char * grown_clean = blkdev_alloc(count);
+  if((grown == NULL) || (grown_clean == NULL)){
+    perror("posix_memalign");
+    exit(EXIT_FAILURE);
+  }
+  /* nothing is pinned before the first call */
+  if(pinned_count > 0){
+    memcpy(grown,       pinned,       (size_t) pinned_count * BLKSIZE);
+    memcpy(grown_clean, pinned_clean, (size_t) pinned_count * BLKSIZE);
+  }
+  free(pinned);
+  free(pinned_clean);
+  pinned       = grown;
+  pinned_clean = grown_clean;
+
+  dev_read(pinned_count, count - pinned_count, &pinned_clean[BLKSIZE * pinned_count]);
+  memcpy(&pinned[BLKSIZE * pinned_count], &pinned_clean[BLKSIZE * pinned_count], (size_t) (count - pinned_count) * BLKSIZE);
+
+  /* blocks already in cache may have been modified, move them over */
+  for(n = pinned_count; n < count; n++){
+    if(slot_of[n] >= 0){
+      memcpy(&pinned[BLKSIZE * n],       slots[slot_of[n]]->data,  BLKSIZE);
+      memcpy(&pinned_clean[BLKSIZE * n], slots[slot_of[n]]->clean, BLKSIZE);
+    }
+  }
+  pinned_count = count;
+
+  /* pinned blocks are no longer looked up in the cache */
+  unsigned int kept = 0;
+  for(n=0; n < slot_count; n++){
+    if(slots[n]->block < pinned_count){
+      slot_of[slots[n]->block] = -1;
+      free(slots[n]);
+    }else{
+      slot_of[slots[n]->block] = kept;
+      slots[kept++] = slots[n];
+    }
+  }
+  slot_count = kept;
+  clock_hand = 0;
+}
+
+static void pread_advise(unsigned int first, unsigned int count, int advice){
+  static const int fadv[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_WILLNEED};
+
+  /* readahead would fill the page cache O_DIRECT keeps out of the way */
+  if(dev_direct){
+    return;
+  }
+  posix_fadvise(dev_fd, (off_t) first * BLKSIZE, (off_t) count * BLKSIZE, fadv[advice]);
+}
+
+static void pread_zero(){
+  if((ftruncate(dev_fd, 0) == -1) || (ftruncate(dev_fd, FSSIZE) == -1)){
+    perror("ftruncate");
+    exit(EXIT_FAILURE);
+  }
+  cache_drop();
+  if(pinned_count > 0){
+    bzero(pinned, (size_t) pinned_count * BLKSIZE);
+    bzero(pinned_clean, (size_t) pinned_count * BLKSIZE);
+  }
+}
+
+static void pread_release(){
+  unsigned int n, kept, dirty = 0;
+
+  pthread_mutex_lock(&cache_lock);
+
+  for(n=0; n < slot_count; n++){
+    slots[n]->busy = 0;
+  }
+
+  /* cache grew past its size during the operation, evict the extra */
+  if(slot_count > CACHE_SLOTS){
+    struct slot ** victims = malloc((slot_count - CACHE_SLOTS) * sizeof(struct slot *));
+    if(victims == NULL){
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+
+    for(n=0; n < slot_count - CACHE_SLOTS; n++){
+      const int i = cache_victim();
+      slots[i]->busy = 1;  //so it is not picked twice
+      slot_of[slots[i]->block] = -1;
+      if(slot_dirty(slots[i])){
+        victims[dirty++] = slots[i];
+      }
+    }
+    cache_writeback(victims, dirty);
+    free(victims);
+
+    for(n=0, kept=0; n < slot_count; n++){
+      if(slot_of[slots[n]->block] == -1){
+        free(slots[n]);
+      }else{
+        slot_of[slots[n]->block] = kept;
+        slots[kept++] = slots[n];
+      }
+    }
+    slot_count = kept;
+    clock_hand = 0;
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void pread_sync(){
+  unsigned int n, first, count = 0;
+
+  /* resident blocks, in runs of modified blocks */
+  for(n=0; n < pinned_count; ){
+    if(memcmp(&pinned[BLKSIZE * n], &pinned_clean[BLKSIZE * n], BLKSIZE) == 0){
+      n++;
+      continue;
+    }
+    for(first = n; (n < pinned_count) && memcmp(&pinned[BLKSIZE * n], &pinned_clean[BLKSIZE * n], BLKSIZE); n++);
+    if(dev_write(first, n - first, &pinned[BLKSIZE * first]) == 0){
+      memcpy(&pinned_clean[BLKSIZE * first], &pinned[BLKSIZE * first], (size_t) (n - first) * BLKSIZE);
+    }
+  }
+
+  /* cached blocks, in block order */
+  struct slot ** dirty = malloc((slot_count + 1) * sizeof(struct slot *));
+  if(dirty == NULL){
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for(n=0; n < slot_count; n++){
+    if(slot_dirty(slots[n])){
+      dirty[count++] = slots[n];
+    }
+  }
+  cache_writeback(dirty, count);
+  free(dirty);
+}
+
+static void pread_close(){
+  pread_sync();
+  cache_drop();
+  free(pinned);
+  free(pinned_clean);
+  pinned = pinned_clean = NULL;
+  pinned_count = 0;
+}
+
+static const struct blkdev pread_dev = {
+  64, pread_ref, pread_read, pread_read_many, pread_write_many, pread_pin, pread_advise, pread_zero, pread_release, pread_sync, pread_close
+};
+
+static void pread_open(int fd, int hints){
+  unsigned int n;
+  for(n=0; n < TOTAL_BLOCKS; n++){
+    slot_of[n] = -1;
+  }
+  dev_fd = fd;
+  blkdev = &pread_dev;
+
+  /* bypass the page cache, all our buffers are aligned for it */
+  if(hints & MAP_HINT_DIRECT){
+    if(BLKSIZE % BLKDEV_ALIGN != 0){
+      fprintf(stderr, "Error: O_DIRECT needs blocks of %d bytes, build with BLKSIZE=%d\n", BLKDEV_ALIGN, BLKDEV_ALIGN);
+      exit(EXIT_FAILURE);
+    }
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == -1){
+      perror("O_DIRECT");
+      exit(EXIT_FAILURE);
+    }
+    dev_direct = 1;
+  }
+}
+
+/* io_uring backend, a pread backend whose bulk I/O is queued all at once */
+
+#define URING_ENTRIES 256
+
+static struct {  // io_uring rings, shared with the kernel
+  int                   fd;
+  unsigned int        * sq_head;
+  unsigned int        * sq_tail;
+  unsigned int        * sq_mask;
+  unsigned int        * sq_array;
+  struct io_uring_sqe * sqes;
+  unsigned int        * cq_head;
+  unsigned int        * cq_tail;
+  unsigned int        * cq_mask;
+  struct io_uring_cqe * cqes;
+} ring;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Queue one read or write, the ring must have room */
+static void uring_queue(int opcode, unsigned int block, unsigned int count, void * buf){
+  const unsigned int tail = *ring.sq_tail;
+  const unsigned int idx  = tail & *ring.sq_mask;
+  struct io_uring_sqe * sqe = &ring.sqes[idx];
+
+  bzero(sqe, sizeof(struct io_uring_sqe));
+  sqe->opcode    = opcode;
+  sqe->fd        = dev_fd;
+  sqe->addr      = (unsigned long) buf;
+  sqe->len       = count * BLKSIZE;
+  sqe->off       = (unsigned long long) block * BLKSIZE;
+  sqe->user_data = count * BLKSIZE;
+
+  ring.sq_array[idx] = idx;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submit queued requests and wait for all of them, -1 if any failed */
+static int uring_wait(unsigned int queued){
+  int failed = 0;
+
+  while(queued > 0){
+    if(syscall(__NR_io_uring_enter, ring.fd, queued, queued, IORING_ENTER_GETEVENTS, NULL, 0) < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("io_uring_enter");
+      return -1;
+    }
+
+    unsigned int head = *ring.cq_head;
+    const unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++, queued--){
+      const struct io_uring_cqe * cqe = &ring.cqes[head & *ring.cq_mask];
+      if(cqe->res != (int) cqe->user_data){
+        fprintf(stderr, "io_uring: %s\n", (cqe->res < 0) ? strerror(-cqe->res) : "short transfer");
+        failed = 1;
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return failed ? -1 : 0;
+}
+
+/* Queue runs of blocks, submitting whenever the ring fills up */
+static int uring_many(int opcode, const unsigned int * blocks, unsigned int count, unsigned char * buf){
+  unsigned int i, n, queued = 0;
+  int failed = 0;
+
+  pthread_mutex_lock(&ring_lock);
+  for(i=0; i < count; i += n){
+    n = run_length(&blocks[i], count - i);
+    uring_queue(opcode, blocks[i], n, &buf[BLKSIZE * i]);
+    if(++queued == URING_ENTRIES){
+      failed |= uring_wait(queued);
+      queued = 0;
+    }
+  }
+  failed |= uring_wait(queued);
+  pthread_mutex_unlock(&ring_lock);
+
+  return failed ? -1 : 0;
+}
+
+static int uring_read_many(const unsigned int * blocks, unsigned int count, void * buf){
+  if(uring_many(IORING_OP_READ, blocks, count, buf) == -1){
+    return -1;
+  }
+  cache_overlay(blocks, count, buf);
+  return 0;
+}
+
+static int uring_write_many(const unsigned int * blocks, unsigned int count, const void * buf){
+  cache_update(blocks, count, buf);
+  return uring_many(IORING_OP_WRITE, blocks, count, (unsigned char *) buf);
+}
+
+static void uring_close(){
+  pread_close();
+  close(ring.fd);
+}
+
+static const struct blkdev uring_dev = {
+  URING_ENTRIES, pread_ref, pread_read, uring_read_many, uring_write_many, pread_pin,
+  pread_advise, pread_zero, pread_release, pread_sync, uring_close
+};
+
+/* Set up the rings, returns -1 if the kernel won't give us one */
+static int uring_open(int fd, int hints){
+  struct io_uring_params params;
+
+  bzero(&params, sizeof(params));
+  ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if(ring.fd < 0){
+    return -1;
+  }
+
+  const size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  const size_t cq_len = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  unsigned char * sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  unsigned char * cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if((sq == MAP_FAILED) || (cq == MAP_FAILED) || (ring.sqes == MAP_FAILED)){
+    close(ring.fd);
+    return -1;
+  }
+
+  ring.sq_head  = (unsigned int *) (sq + params.sq_off.head);
+  ring.sq_tail  = (unsigned int *) (sq + params.sq_off.tail);
+  ring.sq_mask  = (unsigned int *) (sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned int *) (sq + params.sq_off.array);
+  ring.cq_head  = (unsigned int *) (cq + params.cq_off.head);
+  ring.cq_tail  = (unsigned int *) (cq + params.cq_off.tail);
+  ring.cq_mask  = (unsigned int *) (cq + params.cq_off.ring_mask);
+  ring.cqes     = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  pread_open(fd, hints);
+  blkdev = &uring_dev;
+  return 0;
+}
+
+void blkdev_open(int fd, int backend, int hints){
+  switch(backend){
+    case BACKEND_PREAD:
+      pread_open(fd, hints);
+      break;
+    case BACKEND_URING:
+      if(uring_open(fd, hints) == -1){
+        perror("io_uring_setup, using pread");
+        pread_open(fd, hints);
+      }
+      break;
+    case BACKEND_MMAP:
+    default:
+      mmap_open(fd, hints);
+      break;
+  }
+}
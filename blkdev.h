@@ -0,0 +1,39 @@
+#ifndef __BLKDEV_H__
+#define __BLKDEV_H__
+
+/* alignment of buffers given to the backends, enough for O_DIRECT */
+#define BLKDEV_ALIGN 4096
+
+/* access hints, given to advise() */
+enum blkdev_advice {ADV_NORMAL, ADV_SEQUENTIAL, ADV_WILLNEED};
+
+struct blkdev {  // block device backend
+  /* blocks worth reading in one read_many() */
+  unsigned int batch;
+  /* pointer to a block, writes to it are kept until sync() */
+  void *       (*ref)(unsigned int n);
+  /* block data for bulk reads, may use buf, NULL on error */
+  const void * (*read)(unsigned int n, void * buf);
+  /* bulk read of many blocks into consecutive buffers, -1 on error */
+  int          (*read_many)(const unsigned int * blocks, unsigned int count, void * buf);
+  /* bulk write of many blocks from consecutive buffers, -1 on error */
+  int          (*write_many)(const unsigned int * blocks, unsigned int count, const void * buf);
+  /* keep blocks [0, count) resident and contiguous, earlier refs to them are stale */
+  void         (*pin)(unsigned int count);
+  /* hint on how a range of blocks will be used */
+  void         (*advise)(unsigned int first, unsigned int count, int advice);
+  /* zero the whole device */
+  void         (*zero)(void);
+  /* end of an operation, blocks it referenced may be evicted now */
+  void         (*release)(void);
+  /* write back modified blocks */
+  void         (*sync)(void);
+  void         (*close)(void);
+};
+
+extern const struct blkdev * blkdev;
+
+void   blkdev_open(int fd, int backend, int hints);
+void * blkdev_alloc(unsigned int count);
+
+#endif
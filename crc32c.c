@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define POLY 0x82F63B78  /* Castagnoli, reflected */
+
+static uint32_t table[8][256];
+static uint32_t (*crc_fn)(uint32_t, const unsigned char *, size_t) = NULL;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* Build slice-by-8 tables, used when there is no crc32 instruction */
+static void table_init(){
+  uint32_t i, j, crc;
+
+  for(i=0; i < 256; i++){
+    crc = i;
+    for(j=0; j < 8; j++){
+      crc = (crc & 1) ? (crc >> 1) ^ POLY : (crc >> 1);
+    }
+    table[0][i] = crc;
+  }
+
+  for(i=0; i < 256; i++){
+    crc = table[0][i];
+    for(j=1; j < 8; j++){
+      crc = table[0][crc & 0xff] ^ (crc >> 8);
+      table[j][i] = crc;
+    }
+  }
+}
+
+/* Software crc, 8 bytes at a time */
+static uint32_t crc_sw(uint32_t crc, const unsigned char * p, size_t len){
+  uint64_t word;
+
+  while(len >= 8){
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = table[7][ word        & 0xff] ^ table[6][(word >>  8) & 0xff] ^
+          table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+          table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+          table[1][(word >> 48) & 0xff] ^ table[0][ word >> 56        ];
+    p   += 8;
+    len -= 8;
+  }
+
+  while(len--){
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+/* Hardware crc, using the SSE4.2 crc32 instruction */
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char * p, size_t len){
+  uint64_t word;
+  uint64_t crc64 = crc;
+
+  while(len >= 8){
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p   += 8;
+    len -= 8;
+  }
+
+  crc = (uint32_t) crc64;
+  while(len--){
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+/* Pick the fastest implementation this cpu supports */
+static void crc_init(){
+#if defined(__x86_64__)
+  if(__builtin_cpu_supports("sse4.2")){
+    crc_fn = crc_hw;
+    return;
+  }
+#endif
+  table_init();
+  crc_fn = crc_sw;
+}
+
+unsigned int crc32c(const void * buf, size_t len){
+  /* scrub threads may be the first callers, set up only once */
+  pthread_once(&crc_once, crc_init);
+  return ~crc_fn(~0U, (const unsigned char *) buf, len);
+}
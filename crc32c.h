@@ -0,0 +1,7 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+#include <stddef.h>
+
+unsigned int crc32c(const void * buf, size_t len);
+
+#endif
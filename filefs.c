@@ -9,12 +9,16 @@
 #include <string.h>
 
 #include <errno.h>
+#include <limits.h>
 
 #include <sys/mman.h>
 
 #include "fs.h"
 
 int zerosize(int fd);
+int maphints(char* list);
+int quotalimit(const char* text, unsigned int* limit);
+int quotaspec(char* spec, unsigned int* bytes, unsigned int* count);
 void exitusage(char* pname);
 
 
@@ -23,26 +27,158 @@ int main(int argc, char** argv){
   int opt;
   //int create = 0;
   int list = 0;
+  int records = 0;
+  int du = 0;
+  int quota = 0;
+  int find = 0;
+  int features = 0;
+  int lookup = 0;
+  char * tolookup = NULL;
+  char * toxattr = NULL;
+  char * totree = NULL;
+  char * tostream = NULL;
+  char * outdir = ".";
+  char * xattr_get = NULL;
+  char * xattr_set = NULL;
+  struct find_query query = {"*", 0, 0, 0};
+  unsigned int quota_bytes = 0;
+  unsigned int quota_inodes = 0;
+  int format = LIST_JSON;
   int add = 0;
+  int update = 0;
   int remove = 0;
   int extract = 0;
   int debug = 0;
+  int scrub = 0;
+  int check = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int hints = 0;
+  int backend = BACKEND_MMAP;
   char* toadd = NULL;
+  char* toupdate = NULL;
   char* toremove = NULL;
   char* toextract = NULL;
   char* fsname = NULL;
   char * todebug = NULL;
+  char * todu = NULL;
+  char * toquota = NULL;
   int fd = -1;
   int newfs = 0;
+  int status = EXIT_SUCCESS;
   int filefsname = 0;
 
 
 
-  while ((opt = getopt(argc, argv, "ld:a:r:e:f:")) != -1) {
+  while ((opt = getopt(argc, argv, "lL:D:q:F:S:T:NOPn:i:x:g:p:E:o:scj:b:m:d:a:u:r:e:f:")) != -1) {
     switch (opt) {
     case 'l':
       list = 1;
       break;
+    case 'L':
+      records = 1;
+      if (strcmp(optarg, "json") == 0){
+        format = LIST_JSON;
+      }
+      else if (strcmp(optarg, "nul") == 0){
+        format = LIST_NUL;
+      }
+      else if (strcmp(optarg, "path") == 0){
+        format = LIST_PATH;
+      }
+      else{
+        exitusage(argv[0]);
+      }
+      break;
+    case 'D':
+      du = 1;
+      todu = strdup(optarg);
+      break;
+    case 'q':
+      quota = 1;
+      toquota = strdup(optarg);
+      if (quotaspec(toquota, &quota_bytes, &quota_inodes) == -1){
+        exitusage(argv[0]);
+      }
+      break;
+    case 'F':
+      find = 1;
+      query.pattern = strdup(optarg);
+      break;
+    case 'S':
+      /* +n bigger, -n smaller, n exactly, as find(1) */
+      query.size_op = '=';
+      if ((optarg[0] == '+') || (optarg[0] == '-')){
+        query.size_op = (optarg[0] == '+') ? '>' : '<';
+        optarg++;
+      }
+      query.size = strtoul(optarg, NULL, 10);
+      break;
+    case 'T':
+      if ((strcmp(optarg, "f") != 0) && (strcmp(optarg, "d") != 0)){
+        exitusage(argv[0]);
+      }
+      query.type = optarg[0];
+      break;
+    case 'N':
+      features |= FEATURE_NAME_INDEX;
+      break;
+    case 'O':
+      features |= FEATURE_SORTED_DIRS;
+      break;
+    case 'P':
+      features |= FEATURE_TAIL_PACK;
+      break;
+    case 'n':
+      lookup = 1;
+      tolookup = strdup(optarg);
+      break;
+    case 'i':
+      tostream = strdup(optarg);
+      break;
+    case 'E':
+      totree = strdup(optarg);
+      break;
+    case 'o':
+      outdir = strdup(optarg);
+      break;
+    case 'x':
+      toxattr = strdup(optarg);
+      break;
+    case 'g':
+      xattr_get = strdup(optarg);
+      break;
+    case 'p':
+      xattr_set = strdup(optarg);
+      break;
+    case 's':
+      scrub = 1;
+      break;
+    case 'c':
+      check = 1;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'b':
+      if (strcmp(optarg, "mmap") == 0){
+        backend = BACKEND_MMAP;
+      }
+      else if (strcmp(optarg, "pread") == 0){
+        backend = BACKEND_PREAD;
+      }
+      else if (strcmp(optarg, "uring") == 0){
+        backend = BACKEND_URING;
+      }
+      else{
+        exitusage(argv[0]);
+      }
+      break;
+    case 'm':
+      hints = maphints(optarg);
+      if (hints == -1){
+        exitusage(argv[0]);
+      }
+      break;
     case 'd':
       debug = 1;
       todebug = strdup(optarg);
@@ -51,6 +187,10 @@ int main(int argc, char** argv){
       add = 1;
       toadd = strdup(optarg);
       break;
+    case 'u':
+      update = 1;
+      toupdate = strdup(optarg);
+      break;
     case 'r':
       remove = 1;
       toremove = strdup(optarg);
@@ -69,6 +209,10 @@ int main(int argc, char** argv){
   }
 
 
+  if ((xattr_get || xattr_set) && !toxattr){
+    exitusage(argv[0]);
+  }
+
   if (!filefsname){
     exitusage(argv[0]);
   }
@@ -96,18 +240,40 @@ int main(int argc, char** argv){
   }
 
 
-  mapfs(fd);
+  mapfs(fd, backend, hints);
 
   if (newfs){
-    formatfs();
+    formatfs(features);
+  }
+
+  /* fsck repairs all that recovery would, and more */
+  loadfs(!check);
+
+  if (check){
+    fsckfs(threads);
   }
 
-  loadfs();
+  if (quota){
+    quotafs(toquota, quota_bytes, quota_inodes);
+  }
 
   if (add){
     addfilefs(toadd);
   }
 
+  if (tostream){
+    /* a stream can't be given again, say when it wasn't stored */
+    if (streamfs(tostream) == -1){
+      status = EXIT_FAILURE;
+    }
+  }
+
+  if (update){
+    if (updatefilefs(toupdate) == -1){
+      status = EXIT_FAILURE;
+    }
+  }
+
   if (remove){
     removefilefs(toremove);
   }
@@ -116,17 +282,58 @@ int main(int argc, char** argv){
     extractfilefs(toextract);
   }
 
+  if (totree){
+    extracttreefs(totree, outdir);
+  }
+
   if(list){
     lsfs();
   }
 
+  if(records){
+    listfs(format, threads);
+  }
+
+  if(find){
+    findfs(&query, threads);
+  }
+
+  if(toxattr){
+    if(xattr_set){
+      /* name=value sets, a bare name removes */
+      char* value = strchr(xattr_set, '=');
+      if(value){
+        *value++ = '\0';
+      }
+      setxattrfs(toxattr, xattr_set, value);
+    }
+    else if(xattr_get){
+      getxattrfs(toxattr, xattr_get);
+    }
+    else{
+      listxattrfs(toxattr);
+    }
+  }
+
+  if(lookup){
+    namefs(tolookup);
+  }
+
+  if(du){
+    dufs(todu, threads);
+  }
+
   if(debug){
     debugfs(todebug);
   }
 
+  if(scrub){
+    scrubfs(threads);
+  }
+
   unmapfs();
 
-  return 0;
+  return status;
 }
 
 
@@ -138,7 +345,61 @@ int zerosize(int fd){
   return 0;
 }
 
+int maphints(char* list){
+  int hints = 0;
+  char* hint = strtok(list, ",");
+
+  while (hint){
+    if (strcmp(hint, "populate") == 0){
+      hints |= MAP_HINT_POPULATE;
+    }
+    else if (strcmp(hint, "hugepage") == 0){
+      hints |= MAP_HINT_HUGEPAGE;
+    }
+    else if (strcmp(hint, "direct") == 0){
+      hints |= MAP_HINT_DIRECT;
+    }
+    else{
+      fprintf(stderr, "Unknown map hint '%s'\n", hint);
+      return -1;
+    }
+    hint = strtok(NULL, ",");
+  }
+  return hints;
+}
+
+/* Parse a limit, rejecting anything but a number that fits */
+int quotalimit(const char* text, unsigned int* limit){
+  char* end;
+
+  errno = 0;
+  const unsigned long value = strtoul(text, &end, 10);
+  /* strtoul takes signs and blanks, a limit starts with a digit */
+  if ((text[0] < '0') || (text[0] > '9') || *end || (errno == ERANGE) || (value > UINT_MAX)){
+    return -1;
+  }
+  *limit = value;
+  return 0;
+}
+
+/* Split "path,bytes,inodes", cutting path off the limits */
+int quotaspec(char* spec, unsigned int* bytes, unsigned int* count){
+  char* limit = strrchr(spec, ',');
+
+  if ((limit == NULL) || (quotalimit(limit + 1, count) == -1)){
+    return -1;
+  }
+  *limit = '\0';
+
+  limit = strrchr(spec, ',');
+  if ((limit == NULL) || (quotalimit(limit + 1, bytes) == -1)){
+    return -1;
+  }
+  *limit = '\0';
+  return 0;
+}
+
 void exitusage(char* pname){
-  fprintf(stderr, "Usage %s [-l] [-d] [-a path] [-e path] [-r path] -f name\n", pname);
+  fprintf(stderr, "Usage %s [-l] [-L json|nul|path] [-F glob [-S [+-]bytes] [-T f|d]] [-n name|prefix*] [-D path] [-x path [-g name | -p name[=value]]] [-q path,bytes,inodes] [-s] [-c] [-j threads] [-b mmap|pread|uring] [-m populate,hugepage,direct] [-d] [-a path] [-i path] [-u path] [-e path] [-E path [-o dir]] [-r path] [-N] [-O] [-P] -f name\n", pname);
   exit(EXIT_FAILURE);
 }
@@ -1,17 +1,32 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <string.h>
 #include <strings.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fnmatch.h>
+#include <time.h>
 #include "fs.h"
-
-unsigned char* fs;
+#include "crc32c.h"
+#include "blkdev.h"
 
 #define TOTAL_BLOCKS (FSSIZE / BLKSIZE)
 #define BLOCK_ENTRIES (BLKSIZE / sizeof(struct entry))
+#define MAX_REFS      (DREFSIZE + BLKSIZE / sizeof(unsigned short))
+#define BLOCKS_FOR(bytes) (((bytes) + BLKSIZE - 1) / BLKSIZE)
+#define BATCH_BLOCKS  MAX_REFS  /* blocks queued at once for bulk I/O, a whole file */
+#define READAHEAD     256       /* blocks requested past the batch being read */
+#define PIPE_BUFFER   (1 << 20) /* pipe size asked for when streaming */
+
+#define FS_MAGIC   0x46494c45  /* "FILE" */
+#define FS_VERSION 11
 
-enum sector_types {SUPER, FREELIST, INODES, DATA, SECTOR_COUNT};
+enum sector_types {SUPER, FREELIST, INODES, CHECKSUMS, NAMES, DATA, SECTOR_COUNT};
 enum entry_types { E_FILE = 0, E_DIR};
 
 struct sector { // sector describing area on the disk
@@ -20,24 +35,80 @@ struct sector { // sector describing area on the disk
 };
 
 struct metadata {  //metadata found in super block
+  unsigned int magic;
+  unsigned int version;
 	unsigned int total_blocks;
   unsigned int total_inodes;
 	unsigned int block_bytes;
+  unsigned int features;      //FEATURE_ flags, set by format
+  unsigned int xattr_block;   //shared attribute block taking spills, or 0
+  unsigned int tail_block;    //shared tail block taking new tails, or 0
+  unsigned int clean;         //1 once closed, 0 while open or after a crash
 
   struct sector sectors[SECTOR_COUNT];  //sectors in filesystem
 };
 
+struct subtree {  // totals of everything below a directory
+  unsigned int bytes;
+  unsigned int blocks;
+  unsigned int files;
+  unsigned int dirs;
+};
+
+struct quota {  // limits on what goes below a directory, 0 for none
+  unsigned int bytes;   //in whole blocks
+  unsigned int inodes;
+};
+
+#define XATTR_INLINE 128  /* attribute bytes kept in the inode */
+
+struct xattr {  // attribute record header, name and value follow
+  unsigned short inode;      //owner, shared blocks hold many
+  unsigned char  name_len;   //0 ends the records
+  unsigned char  value_len;
+};
+
+#define TAIL_MAX (BLKSIZE / 2)  /* longer tails keep their own block */
+
+struct tail_head {  // start of a shared tail block, tails follow
+  unsigned short refs;  //tails in the block
+  unsigned short used;  //bytes taken, new tails go after
+};
+
 struct inode {  //inode in filesystem
 	unsigned short dref[DREFSIZE]; //direct references
   unsigned short iref;           //indirect reference block
-	unsigned char  total_ref;      //total references
+	unsigned short total_ref;      //total references
+  unsigned short parent;         //directory holding the inode
+  struct subtree tree;           //kept up to date on directories
+  struct quota   quota;
+  unsigned int   uid;            //owner and mode from the host, 0 mode until set
+  unsigned int   gid;
+  unsigned int   mode;
+  unsigned short tail_block;     //shared block with the partial last block of a file
+  unsigned short tail_off;
+  unsigned short tail_len;       //0 when the file has no packed tail
+  unsigned short xattr_block;    //shared block with attributes past inline ones
+  unsigned char  xattr[XATTR_INLINE];
 };
 
 struct entry {  // filesystem entry
   char             name[NAMESIZE];
+  unsigned char    name_len;  //name bytes, up to NAMESIZE
 	unsigned int     size;
   enum entry_types type;
   unsigned int     inode;
+  unsigned int     hash;      //name_hash() of name
+};
+
+#define INDEX_SLOTS 256  /* power of two, over twice TOTAL_INODES */
+#define INDEX_HEAD  8    /* name bytes kept for prefix search */
+
+struct name_slot {  // name index record, free when inode is 0
+  unsigned int   hash;
+  unsigned short inode;
+  unsigned short parent;
+  char           head[INDEX_HEAD];
 };
 
 /* section pointers */
@@ -46,7 +117,13 @@ static unsigned char      * bitlist = NULL;
 static struct inode       * inodes  = NULL;
 
 /* Helper functions */
-static void * block_ref(unsigned int n) { return &fs[BLKSIZE * n]; }
+static void *       block_ref(unsigned int n)             { return blkdev->ref(n); }
+static const void * block_read(unsigned int n, void * buf){ return blkdev->read(n, buf); }
+
+/* Advise the kernel on how a range of blocks will be used */
+static void advise_blocks(const unsigned int first, const unsigned int count, const int advice){
+  blkdev->advise(first, count, advice);
+}
 
 /* Print n space on a line */
 static void print_indent(int n){
@@ -71,39 +148,437 @@ static void print_indent(int n){
     for(j=0; j < BLOCK_ENTRIES; j++, entry_ptr++)
 
 
+/* Free block summary, kept in the FREELIST sector after the bit list.
+   Level 0 is the bit list, a bit of level k is set when the 64 bit word it
+   stands for in level k-1 is full, up to a level that fits in one word. */
+#define SUMMARY_LEVELS 8
+
+static unsigned long long * level[SUMMARY_LEVELS];
+static unsigned int         level_bits[SUMMARY_LEVELS];
+static unsigned int         levels = 0;
+
+static unsigned int words_for(const unsigned int bits){ return (bits + 63) / 64; }
+
+/* Words taken by the bit list and its summary, bits per level filled in if asked */
+static unsigned int summary_layout(const unsigned int blocks, unsigned int * bits, unsigned int * depth){
+  unsigned int n = blocks, total = 0, k = 0;
+
+  for(;;){
+    if(bits != NULL){
+      bits[k] = n;
+    }
+    total += words_for(n);
+    k++;
+    if(n <= 64){
+      break;
+    }
+    n = words_for(n);
+  }
+  if(depth != NULL){
+    *depth = k;
+  }
+  return total;
+}
+
+/* Word w of level k changed, carry it up while the levels above change too */
+static void summary_set(unsigned int k, unsigned int w){
+  for(; k + 1 < levels; k++, w /= 64){
+    unsigned long long * up = &level[k + 1][w / 64];
+    const unsigned long long was = *up;
+
+    if(level[k][w] == ~0ULL){
+      *up |=  (1ULL << (w % 64));
+    }else{
+      *up &= ~(1ULL << (w % 64));
+    }
+    if(*up == was){
+      break;
+    }
+  }
+}
+
 /* Bit list manipulation */
-static void bitlist_up(    unsigned int n){         bitlist[n / 8] |=  (1 << (n % 8)); }
-static void bitlist_down(  unsigned int n){         bitlist[n / 8] &= ~(1 << (n % 8)); }
+static void bitlist_up(    unsigned int n){         bitlist[n / 8] |=  (1 << (n % 8)); summary_set(0, n / 64); }
+static void bitlist_down(  unsigned int n){         bitlist[n / 8] &= ~(1 << (n % 8)); summary_set(0, n / 64); }
 static int  bitlist_status(unsigned int n){ return (bitlist[n / 8] &   (1 << (n % 8)));}
 
-/* Get a free data block */
-static unsigned int get_data_block(){
-  unsigned int i;
-  for(i = meta->sectors[DATA].sector_start; i < meta->total_blocks; i++){
-    if(bitlist_status(i) == 0){
-      bitlist_up(i);
+/* Set or clear a bit range, whole bytes in the middle and masks at the edges */
+static void bits_fill(unsigned char * map, unsigned int first, unsigned int count, const int value){
+  while(count > 0){
+    const unsigned int bit = first % 8;
+
+    if((bit == 0) && (count >= 8)){
+      memset(&map[first / 8], value ? 0xff : 0, count / 8);
+      first += count & ~7u;
+      count &= 7;
+      continue;
+    }
+
+    const unsigned int len = (count < 8 - bit) ? count : 8 - bit;
+    const unsigned char mask = ((1u << len) - 1) << bit;
+    if(value){
+      map[first / 8] |= mask;
+    }else{
+      map[first / 8] &= ~mask;
+    }
+    first += len;
+    count -= len;
+  }
+}
+
+/* First bit in [first, last) equal to value, or last if there is none */
+static unsigned int bits_find(const unsigned char * map, unsigned int first, const unsigned int last, const int value){
+  const unsigned long long skip = value ? 0 : ~0ULL;
+  unsigned long long word;
+
+  /* bit by bit up to a byte, then a word at a time */
+  while((first < last) && (first % 8)){
+    if(((map[first / 8] >> (first % 8)) & 1) == value){
+      return first;
+    }
+    first++;
+  }
+  while(last - first >= 64){
+    memcpy(&word, &map[first / 8], sizeof(word));
+    if(word != skip){
+      break;
+    }
+    first += 64;
+  }
+  while(first < last){
+    if(((map[first / 8] >> (first % 8)) & 1) == value){
+      return first;
+    }
+    first++;
+  }
+  return last;
+}
+
+/* Set or clear a range of the bit list, then the summary words above it */
+static void bitlist_fill(const unsigned int first, const unsigned int count, const int value){
+  unsigned int w;
+
+  if(count == 0){
+    return;
+  }
+  bits_fill(bitlist, first, count, value);
+  for(w = first / 64; w <= (first + count - 1) / 64; w++){
+    summary_set(0, w);
+  }
+}
+
+/* Rebuild the summary from the bit list, returns the number of words changed */
+static unsigned int summary_build(){
+  unsigned int k, w, changed = 0;
+
+  /* bits past the end of each level read as used */
+  for(k = 0; k < levels; k++){
+    bits_fill((unsigned char *) level[k], level_bits[k], words_for(level_bits[k]) * 64 - level_bits[k], 1);
+  }
+  for(k = 1; k < levels; k++){
+    for(w = 0; w < level_bits[k]; w++){
+      unsigned long long * up = &level[k][w / 64];
+      const unsigned long long was = *up;
+
+      if(level[k - 1][w] == ~0ULL){
+        *up |=  (1ULL << (w % 64));
+      }else{
+        *up &= ~(1ULL << (w % 64));
+      }
+      changed += (*up != was);
+    }
+  }
+  return changed;
+}
+
+/* First free block from n on, or total_blocks. Climbs the summary past full
+   words, then takes the first clear bit on the way back down. */
+static unsigned int summary_find(const unsigned int n){
+  unsigned int k, p = n / 64 + 1;
+  unsigned int i = bits_find(bitlist, n, p * 64, 0);
+
+  if(i < p * 64){
+    return i;
+  }
+  for(k = 1; k < levels; k++){
+    if(p >= level_bits[k]){
+      return meta->total_blocks;
+    }
+    const unsigned long long free = ~level[k][p / 64] & (~0ULL << (p % 64));
+    if(free){
+      p = (p & ~63u) + __builtin_ctzll(free);
+      break;
+    }
+    p = p / 64 + 1;
+  }
+  if(k == levels){
+    return meta->total_blocks;
+  }
+  for(k--; k > 0; k--){
+    if(level[k][p] == ~0ULL){
+      /* summary is stale, fsck will rebuild it */
+      return bits_find(bitlist, n, meta->total_blocks, 0);
+    }
+    p = p * 64 + __builtin_ctzll(~level[k][p]);
+  }
+  i = bits_find(bitlist, p * 64, (p + 1) * 64, 0);
+  if(i == (p + 1) * 64){
+    return bits_find(bitlist, n, meta->total_blocks, 0);
+  }
+  return (i < meta->total_blocks) ? i : meta->total_blocks;
+}
+
+/* First run of count free blocks in the data sector, or total_blocks.
+   The summary finds each free block, the rest of the run is a range test */
+static unsigned int summary_run(const unsigned int count){
+  unsigned int i = summary_find(meta->sectors[DATA].sector_start);
+
+  while((i < meta->total_blocks) && (count <= meta->total_blocks - i)){
+    const unsigned int used = bits_find(bitlist, i, i + count, 1);
+    if(used == i + count){
+      return i;
+    }
+    if(used + 1 >= meta->total_blocks){
+      break;
+    }
+    i = summary_find(used + 1);
+  }
+  return meta->total_blocks;
+}
+
+/* Block checksums, kept for file data and tail blocks only */
+/* Checksum of block n, its sector is read through the cache like data */
+static unsigned int * csum_ref(const unsigned int n){
+  const unsigned int per = BLKSIZE / sizeof(unsigned int);
+  return (unsigned int *) block_ref(meta->sectors[CHECKSUMS].sector_start + n / per) + n % per;
+}
+
+static void csum_update(unsigned int n, const void * data){         *csum_ref(n) = crc32c(data, BLKSIZE); }
+static int  csum_verify(unsigned int n, const void * data){ return (*csum_ref(n) == crc32c(data, BLKSIZE));}
+
+/* Blocks held by an inode, with its indirect block. A packed tail is
+   charged as the block it replaced, so quotas see no difference, and
+   a share of an attribute block as a block of its own */
+static unsigned int inode_blocks(const struct inode * inode_ptr){
+  return inode_ptr->total_ref + (inode_ptr->iref > 0) + (inode_ptr->tail_len > 0) + (inode_ptr->xattr_block > 0);
+}
+
+/* Add to the subtree totals of a directory and all above it */
+static void subtree_add(unsigned int dir, const int bytes, const int blocks, const int files, const int dirs){
+  int depth;
+
+  /* a damaged parent chain can't loop forever */
+  for(depth=0; depth < TOTAL_INODES; depth++){
+    struct subtree * tree = &inodes[dir].tree;
+    tree->bytes  += bytes;
+    tree->blocks += blocks;
+    tree->files  += files;
+    tree->dirs   += dirs;
+    if(dir == 0){
+      break;
+    }
+    dir = inodes[dir].parent;
+  }
+}
+
+/* Account blocks gained or lost by an inode, root has nothing above */
+static void subtree_blocks(const struct inode * inode_ptr, const int blocks){
+  if((inode_ptr != &inodes[0]) && (blocks != 0)){
+    subtree_add(inode_ptr->parent, 0, blocks, 0, 0);
+  }
+}
+
+/* Check there is room for more blocks and inodes below a directory,
+   and below all directories above it */
+static int quota_check(unsigned int dir, const unsigned int blocks, const unsigned int count){
+  int depth;
+
+  for(depth=0; depth < TOTAL_INODES; depth++){
+    const struct inode * inode_ptr = &inodes[dir];
+    const struct subtree * tree = &inode_ptr->tree;
+
+    if(inode_ptr->quota.bytes && ((unsigned long long) (tree->blocks + blocks) * BLKSIZE > inode_ptr->quota.bytes)){
+      fprintf(stderr, "Error: Byte quota of directory inode %u exceeded\n", dir);
+      return -1;
+    }
+    if(inode_ptr->quota.inodes && (tree->files + tree->dirs + count > inode_ptr->quota.inodes)){
+      fprintf(stderr, "Error: Inode quota of directory inode %u exceeded\n", dir);
+      return -1;
+    }
+    if(dir == 0){
       break;
     }
+    dir = inode_ptr->parent;
+  }
+  return 0;
+}
+
+/* Get a free data block, the first one from goal on, wrapping around */
+static unsigned int get_data_block(unsigned int goal){
+  const unsigned int start = meta->sectors[DATA].sector_start;
+  unsigned int i;
+
+  if((goal < start) || (goal >= meta->total_blocks)){
+    goal = start;
+  }
+  i = summary_find(goal);
+  if((i == meta->total_blocks) && (goal > start)){
+    i = summary_find(start);
+    if(i >= goal){
+      i = meta->total_blocks;
+    }
+  }
+  if(i < meta->total_blocks){
+    bitlist_up(i);
   }
   return i;
 }
 
+/* Inode holds data, packed files may have no blocks of their own */
+static int inode_used(const struct inode * inode_ptr){
+  return (inode_ptr->total_ref > 0) || (inode_ptr->tail_len > 0);
+}
+
 /* Get a free inode */
 static unsigned int get_inode(){
   unsigned int i;
   for(i=0; i < TOTAL_INODES; i++){
-    if(inodes[i].total_ref == 0){
+    if(!inode_used(&inodes[i])){
       break;
     }
   }
   return i;
 }
 
+static int dirs_sorted(){ return meta->features & FEATURE_SORTED_DIRS; }
+
+static unsigned int inode_block(const struct inode * inode_ptr, const unsigned int n);
+
+/* Entry slots of a directory, the root keeps its own entry in slot 0 */
+static unsigned int dir_first(const struct inode * inode_ptr){ return inode_ptr == &inodes[0]; }
+static unsigned int dir_slots(const struct inode * inode_ptr){ return inode_ptr->total_ref * BLOCK_ENTRIES; }
+
+/* FNV-1a hash of a name */
+static unsigned int name_hash(const char * name, const size_t len){
+  unsigned int hash = 2166136261u;
+  size_t i;
+
+  for(i=0; i < len; i++){
+    hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/* Name an entry, keeping its length and hash for lookups */
+static void entry_name(struct entry * entry_ptr, const char * name){
+  strncpy(entry_ptr->name, name, NAMESIZE);
+  entry_ptr->name_len = strnlen(entry_ptr->name, NAMESIZE);
+  entry_ptr->hash     = name_hash(entry_ptr->name, entry_ptr->name_len);
+}
+
+/* Entry has a name, hash and length are compared before the name itself */
+static int entry_is(const struct entry * entry_ptr, const char * name, const size_t len, const unsigned int hash){
+  return (entry_ptr->hash == hash) && (entry_ptr->name_len == len) && (memcmp(entry_ptr->name, name, len) == 0);
+}
+
+static struct entry * entry_at(const struct inode * inode_ptr, const unsigned int k){
+  return (struct entry *) block_ref(inode_block(inode_ptr, k / BLOCK_ENTRIES)) + k % BLOCK_ENTRIES;
+}
+
+/* Sorted directories keep used slots first and in name order.
+   Returns the first slot not below name, free slots sort last */
+static unsigned int entry_bound(const struct inode * inode_ptr, const char * name, const size_t len){
+  unsigned int lo = dir_first(inode_ptr), hi = dir_slots(inode_ptr);
+
+  while(lo < hi){
+    const unsigned int mid = lo + (hi - lo) / 2;
+    const struct entry * entry_ptr = entry_at(inode_ptr, mid);
+    if((entry_ptr->name[0] != '\0') && (strncmp(entry_ptr->name, name, len) < 0)){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Returns the first free slot of a sorted directory */
+static unsigned int entry_end(const struct inode * inode_ptr){
+  unsigned int lo = dir_first(inode_ptr), hi = dir_slots(inode_ptr);
+
+  while(lo < hi){
+    const unsigned int mid = lo + (hi - lo) / 2;
+    if(entry_at(inode_ptr, mid)->name[0] != '\0'){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Open a slot for name in a sorted directory, moving the ones after it up.
+   The directory must have a free slot */
+static struct entry * entry_insert(struct inode * inode_ptr, const char * name){
+  const unsigned int pos = entry_bound(inode_ptr, name, NAMESIZE);
+  unsigned int k;
+
+  for(k = entry_end(inode_ptr); k > pos; k--){
+    *entry_at(inode_ptr, k) = *entry_at(inode_ptr, k - 1);
+  }
+  struct entry * entry_ptr = entry_at(inode_ptr, pos);
+  bzero(entry_ptr, sizeof(struct entry));
+  return entry_ptr;
+}
+
+/* Put a sorted directory back in order, used slots first.
+   Returns the number of entries moved */
+static int entry_sort(struct inode * inode_ptr){
+  unsigned int k, i, used = dir_first(inode_ptr);
+  int moved = 0;
+
+  /* compact, then insertion sort, directories are small */
+  for(k = used; k < dir_slots(inode_ptr); k++){
+    struct entry * entry_ptr = entry_at(inode_ptr, k);
+    if(entry_ptr->name[0] == '\0'){
+      continue;
+    }
+
+    const struct entry moving = *entry_ptr;
+    for(i = used; (i > dir_first(inode_ptr)) && (strncmp(entry_at(inode_ptr, i - 1)->name, moving.name, NAMESIZE) > 0); i--){
+      *entry_at(inode_ptr, i) = *entry_at(inode_ptr, i - 1);
+    }
+    if(i != k){
+      if(used != k){
+        bzero(entry_ptr, sizeof(struct entry));
+      }
+      *entry_at(inode_ptr, i) = moving;
+      moved++;
+    }
+    used++;
+  }
+  return moved;
+}
+
 /* Search for an entry by name */
 static struct entry* search_entry(struct inode * inode_ptr, const char * name){
+  const size_t len = strnlen(name, NAMESIZE);
+  const unsigned int hash = name_hash(name, len);
+
+  if(dirs_sorted()){
+    const unsigned int k = name[0] ? entry_bound(inode_ptr, name, NAMESIZE) : entry_end(inode_ptr);
+    if(k < dir_slots(inode_ptr)){
+      struct entry * entry_ptr = entry_at(inode_ptr, k);
+      if((len == 0) ? (entry_ptr->name[0] == '\0') : entry_is(entry_ptr, name, len, hash)){
+        return entry_ptr;
+      }
+    }
+    return NULL;
+  }
 
+  /* free slots are zeroed, so hash and length never match a name */
   FOREACH_ENTRY(inode_ptr){
-      if(strcmp(name, entry_ptr->name) == 0){
+      if((len == 0) ? (entry_ptr->name[0] == '\0') : entry_is(entry_ptr, name, len, hash)){
         return entry_ptr;
       }
     }
@@ -114,7 +589,7 @@ static struct entry* search_entry(struct inode * inode_ptr, const char * name){
 /* Expand inode, using the indirect references */
 static int expand_indirect(struct inode * inode_ptr, const unsigned int block){
   if(inode_ptr->iref == 0){
-    const unsigned int iref = get_data_block();
+    const unsigned int iref = get_data_block(block + 1);
     if(iref == meta->total_blocks){
       fprintf(stderr, "Error: Enlarge failed, no blocks\n");
       return -1;
@@ -128,397 +603,2926 @@ static int expand_indirect(struct inode * inode_ptr, const unsigned int block){
   return 0;
 }
 
-/* Expand inode, using the direct references */
-static int expand(struct inode * inode_ptr){
+/* Expand inode, using the direct references. Quota is checked unless
+   the block only replaces one already charged */
+static int expand_block(struct inode * inode_ptr, const int quota){
+
+  if(inode_ptr->total_ref == MAX_REFS){
+    fprintf(stderr, "Error: Enlarge failed, file too big\n");
+    return -1;
+  }
+
+  /* the first indirect reference takes a block too */
+  const unsigned int needed = 1 + ((inode_ptr->total_ref == DREFSIZE) && (inode_ptr->iref == 0));
+  if(quota && (inode_ptr != &inodes[0]) && (quota_check(inode_ptr->parent, needed, 0) == -1)){
+    return -1;
+  }
 
-  int block = get_data_block();
+  /* keep the file contiguous when the next block is free */
+  const unsigned int goal = (inode_ptr->total_ref > 0) ? inode_block(inode_ptr, inode_ptr->total_ref - 1) + 1 : 0;
+  int block = get_data_block(goal);
   if(block == meta->total_blocks){ //if a free block wasn't found
     fprintf(stderr, "Error: Enlarge failed, no free blocks\n");
     return -1;
   }
 
+  const unsigned int before = inode_blocks(inode_ptr);
   if(inode_ptr->total_ref < DREFSIZE){
     inode_ptr->dref[inode_ptr->total_ref] = block;
   }else{
     expand_indirect(inode_ptr, block);
   }
   inode_ptr->total_ref++;
+  subtree_blocks(inode_ptr, inode_blocks(inode_ptr) - before);
   return block;
 }
 
-/* Add entry by name, or return existing entry */
-static struct entry* get_entry(struct entry * entry_ptr, const char * name){
-  struct inode * inode_ptr = &inodes[entry_ptr->inode];
-  struct inode * einode_ptr = NULL;
+static int expand(struct inode * inode_ptr){ return expand_block(inode_ptr, 1); }
 
-  /* if entry exist */
-  entry_ptr = search_entry(inode_ptr, name);
-  if(entry_ptr != NULL){
-    return entry_ptr;
+/* Get the n-th data block of an inode */
+static unsigned int inode_block(const struct inode * inode_ptr, const unsigned int n){
+  if(n < DREFSIZE){
+    return inode_ptr->dref[n];
   }
+  const unsigned short *indirect = (unsigned short *) block_ref(inode_ptr->iref);
+  return indirect[n - DREFSIZE];
+}
 
-  /* find free entry in dir to store */
-  entry_ptr = search_entry(inode_ptr, "");
-  if(entry_ptr == NULL){
-    if(expand(inode_ptr) == -1){
-      return NULL;
+/* Block is inside the data sector */
+static int in_data(const unsigned int block){
+  return (block >= meta->sectors[DATA].sector_start) && (block < meta->total_blocks);
+}
+
+/* Check that the block map of an inode can be walked safely, every
+   reference has to be inside the data sector before any is read */
+static int inode_walkable(const struct inode * inode_ptr){
+  unsigned int i;
+
+  if(inode_ptr->total_ref > MAX_REFS){
+    return 0;
+  }
+  if((inode_ptr->iref != 0) && !in_data(inode_ptr->iref)){
+    return 0;
+  }
+  if((inode_ptr->total_ref > DREFSIZE) && (inode_ptr->iref == 0)){
+    return 0;
+  }
+  for(i=0; (i < inode_ptr->total_ref) && (i < DREFSIZE); i++){
+    if(!in_data(inode_ptr->dref[i])){
+      return 0;
     }
-    entry_ptr = search_entry(inode_ptr, "");
   }
-
-  /* find inode */
-  const int inode = get_inode();
-  if(inode == TOTAL_INODES){
-    return NULL;
+  if(inode_ptr->total_ref > DREFSIZE){
+    const unsigned short * indirect = (unsigned short *) block_ref(inode_ptr->iref);
+    for(i = DREFSIZE; i < inode_ptr->total_ref; i++){
+      if(!in_data(indirect[i - DREFSIZE])){
+        return 0;
+      }
+    }
   }
-  einode_ptr = &inodes[inode];
+  return 1;
+}
 
-  bzero(einode_ptr, sizeof(struct inode));
+/* Shrink inode, releasing its last data block */
+static void shrink(struct inode * inode_ptr){
+  const unsigned int before = inode_blocks(inode_ptr);
 
-  /* assign data block to inode */
-  if(expand(einode_ptr) == -1){
-    return NULL;
+  inode_ptr->total_ref--;
+  bitlist_down(inode_block(inode_ptr, inode_ptr->total_ref));
+
+  /* release indirect block, once its empty */
+  if((inode_ptr->total_ref == DREFSIZE) && (inode_ptr->iref > 0)){
+    bitlist_down(inode_ptr->iref);
+    inode_ptr->iref = 0;
   }
+  subtree_blocks(inode_ptr, inode_blocks(inode_ptr) - before);
+}
 
-  /* store entry data */
-  strncpy(entry_ptr->name, name, NAMESIZE);
-  entry_ptr->inode = inode;
-  entry_ptr->type = E_DIR;
-  entry_ptr->size = 0;
+static int tails_enabled(){ return meta->features & FEATURE_TAIL_PACK; }
 
-  return entry_ptr;
+/* Drop a file's tail, freeing the tail block once it holds none */
+static void tail_release(struct inode * inode_ptr){
+  const unsigned int block = inode_ptr->tail_block;
+
+  if(inode_ptr->tail_len == 0){
+    return;
+  }
+  const unsigned int before = inode_blocks(inode_ptr);
+  struct tail_head * head = block_ref(block);
+  if(--head->refs == 0){
+    bitlist_down(block);
+    if(meta->tail_block == block){
+      meta->tail_block = 0;
+    }
+  }else{
+    csum_update(block, head);
+  }
+  inode_ptr->tail_block = inode_ptr->tail_off = inode_ptr->tail_len = 0;
+  subtree_blocks(inode_ptr, inode_blocks(inode_ptr) - before);
 }
 
-/* Write data to entry */
-static int write_entry(struct entry * entry_ptr, const int fd){
-  int i=0;
+/* Move the partial last block of a file into the shared tail block.
+   Tails are bump allocated, space comes back when the block empties */
+static void tail_pack(struct entry * entry_ptr){
   struct inode * inode_ptr = &inodes[entry_ptr->inode];
-  unsigned char * block_ptr = block_ref(inode_ptr->dref[0]);
+  const unsigned int len = entry_ptr->size % BLKSIZE;
+  unsigned int block = meta->tail_block;
 
-  entry_ptr->size = 0;
+  if(!tails_enabled() || (len == 0) || (len > TAIL_MAX) || (inode_ptr->tail_len > 0) ||
+     (inode_ptr->total_ref != BLOCKS_FOR(entry_ptr->size))){
+    return;
+  }
 
-  while(1){
+  unsigned char * buf = blkdev_alloc(1);
+  if(buf == NULL){
+    return;
+  }
+  const unsigned char * data = block_read(inode_block(inode_ptr, inode_ptr->total_ref - 1), buf);
+  if(data == NULL){
+    free(buf);
+    return;
+  }
 
-    /* read from file to block buffer */
-    const int n = read(fd, &block_ptr[i], BLKSIZE - i);
-    if(n < 0){
-      perror("read");
-      break;
-    }else if(n == 0){
-      break;
-    }
-    /* increase entry size */
-    entry_ptr->size += n;
-
-    /* if we have read a whole block */
-    if(i == BLKSIZE){
-      i = 0;
-      /* get another one */
-      const unsigned int block = expand(inode_ptr);
-      if(block == -1){  //if not free block
-        break;
-      }
-      block_ptr = block_ref(block);
-    }else{
-      /* advance block pointer index with bytes read */
-      i += n;
+  struct tail_head * head = block ? block_ref(block) : NULL;
+  if((head == NULL) || (head->used + len > BLKSIZE)){
+    block = get_data_block(0);
+    if(block == meta->total_blocks){
+      free(buf);
+      return;
     }
+    head = block_ref(block);
+    bzero(head, BLKSIZE);
+    head->used = sizeof(struct tail_head);
+    meta->tail_block = block;
   }
-  return entry_ptr->size;
+
+  const unsigned int off = head->used;
+  memcpy((unsigned char *) head + off, data, len);
+  head->used += len;
+  head->refs++;
+  csum_update(block, head);
+  free(buf);
+
+  /* the tail is charged in place of the last block */
+  shrink(inode_ptr);
+  const unsigned int before = inode_blocks(inode_ptr);
+  inode_ptr->tail_block = block;
+  inode_ptr->tail_off   = off;
+  inode_ptr->tail_len   = len;
+  subtree_blocks(inode_ptr, inode_blocks(inode_ptr) - before);
 }
 
-/* Read data from entry to file */
-static int entry_read(struct entry * entry_ptr, FILE * out){
-  struct inode * inode_ptr = &inodes[entry_ptr->inode];
-  int size = entry_ptr->size;
+/* Move a file's tail back into a block of its own */
+static int tail_unpack(struct inode * inode_ptr){
+  if(inode_ptr->tail_len == 0){
+    return 0;
+  }
 
-  FOREACH_BLOCK(inode_ptr)
-    const int n = (size > BLKSIZE) ? BLKSIZE : size;
-    size -= n;
-    fwrite(block_ref(block), 1, n, out);
+  /* the tail was charged as a block already */
+  const int block = expand_block(inode_ptr, 0);
+  if(block == -1){
+    return -1;
   }
+  unsigned char * data = block_ref(block);
+  bzero(data, BLKSIZE);
+  memcpy(data, (unsigned char *) block_ref(inode_ptr->tail_block) + inode_ptr->tail_off, inode_ptr->tail_len);
+  csum_update(block, data);
+
+  tail_release(inode_ptr);
   return 0;
 }
 
+/* Advise the kernel on how the blocks of an inode will be used */
+static void advise_inode(const struct inode * inode_ptr, const int advice){
+  unsigned int first = meta->total_blocks, last = 0;
 
-/* Remove entry from a directory */
-static void entry_remove(struct entry * entry_ptr){
-
-  struct inode * inode_ptr = &inodes[entry_ptr->inode];
-
-  /* release each data block hold by inode */
   FOREACH_BLOCK(inode_ptr)
-    bitlist_down(block);
+    first = (block < first) ? block : first;
+    last  = (block > last)  ? block : last;
   }
 
-  if(inode_ptr->iref > 0){
-    /* release indirect data block hold by inode */
-    bitlist_down(inode_ptr->iref);
+  if(first <= last){
+    advise_blocks(first, last - first + 1, advice);
   }
+}
 
-  /* zero out entry and inode memory */
+static int index_enabled(){ return meta->features & FEATURE_NAME_INDEX; }
+
+/* Record i of an index table. A NULL table is the one on the image,
+   read a block at a time through the cache */
+static struct name_slot * index_slot(struct name_slot * table, const unsigned int i){
+  const unsigned int per = BLKSIZE / sizeof(struct name_slot);
+
+  if(table != NULL){
+    return &table[i];
+  }
+  return (struct name_slot *) block_ref(meta->sectors[NAMES].sector_start + i / per) + i % per;
+}
+
+/* Add a name to an index table, linear probing from its hash */
+static void index_add(struct name_slot * table, const char * name, const unsigned int inode, const unsigned int parent){
+  const size_t len = strnlen(name, NAMESIZE);
+  const unsigned int hash = name_hash(name, len);
+  unsigned int i = hash & (INDEX_SLOTS - 1);
+  struct name_slot * slot;
+
+  /* there are more slots than inodes, a free one is always found */
+  while((slot = index_slot(table, i))->inode != 0){
+    i = (i + 1) & (INDEX_SLOTS - 1);
+  }
+  slot->hash   = hash;
+  slot->inode  = inode;
+  slot->parent = parent;
+  strncpy(slot->head, name, (len < INDEX_HEAD) ? len + 1 : INDEX_HEAD);
+}
+
+/* Remove a name from the index, shifting back the records after it */
+static void index_remove(const char * name, const unsigned int inode){
+  unsigned int i = name_hash(name, strnlen(name, NAMESIZE)) & (INDEX_SLOTS - 1);
+  unsigned int j, home;
+
+  while(index_slot(NULL, i)->inode != inode){
+    if(index_slot(NULL, i)->inode == 0){
+      return;
+    }
+    i = (i + 1) & (INDEX_SLOTS - 1);
+  }
+
+  /* a record can move back, unless its home lies in (i, j] */
+  for(j = (i + 1) & (INDEX_SLOTS - 1); index_slot(NULL, j)->inode != 0; j = (j + 1) & (INDEX_SLOTS - 1)){
+    home = index_slot(NULL, j)->hash & (INDEX_SLOTS - 1);
+    if((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j))){
+      continue;
+    }
+    *index_slot(NULL, i) = *index_slot(NULL, j);
+    i = j;
+  }
+  bzero(index_slot(NULL, i), sizeof(struct name_slot));
+}
+
+/* Add entry by name, or return existing entry */
+static struct entry* get_entry(struct entry * entry_ptr, const char * name){
+  const unsigned int dir = entry_ptr->inode;
+  struct inode * inode_ptr = &inodes[dir];
+  struct inode * einode_ptr = NULL;
+
+  /* if entry exist */
+  entry_ptr = search_entry(inode_ptr, name);
+  if(entry_ptr != NULL){
+    return entry_ptr;
+  }
+
+  /* find free entry in dir to store */
+  entry_ptr = search_entry(inode_ptr, "");
+  if(entry_ptr == NULL){
+    const int block = expand(inode_ptr);
+    if(block == -1){
+      return NULL;
+    }
+    /* released blocks keep old data, clear it */
+    bzero(block_ref(block), BLKSIZE);
+    entry_ptr = search_entry(inode_ptr, "");
+  }
+
+  /* find inode */
+  if(quota_check(dir, 0, 1) == -1){
+    return NULL;
+  }
+  const int inode = get_inode();
+  if(inode == TOTAL_INODES){
+    return NULL;
+  }
+  einode_ptr = &inodes[inode];
+
+  bzero(einode_ptr, sizeof(struct inode));
+  einode_ptr->parent = dir;
+  subtree_add(dir, 0, 0, 0, 1);
+
+  /* assign data block to inode */
+  const int block = expand(einode_ptr);
+  if(block == -1){
+    subtree_add(dir, 0, 0, 0, -1);
+    return NULL;
+  }
+  bzero(block_ref(block), BLKSIZE);
+  csum_update(block, block_ref(block));
+
+  /* store entry data, sorted directories have it go in order */
+  if(dirs_sorted()){
+    entry_ptr = entry_insert(inode_ptr, name);
+  }
+  entry_name(entry_ptr, name);
+  entry_ptr->inode = inode;
+  if(index_enabled()){
+    index_add(NULL, entry_ptr->name, inode, dir);
+  }
+  entry_ptr->type = E_DIR;
+  entry_ptr->size = 0;
+
+  return entry_ptr;
+}
+
+/* Read a batch of blocks from file, zero padding the last one. Large
+   reads fill it, so pipes are drained a buffer at a time.
+   Returns bytes read, count is set to the blocks used */
+static int read_batch(const int fd, unsigned char * buf, unsigned int * count){
+  const int want = BATCH_BLOCKS * BLKSIZE;
+  int total = 0;
+
+  while(total < want){
+    const ssize_t n = read(fd, &buf[total], want - total);
+    if(n < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("read");
+      return -1;
+    }else if(n == 0){
+      break;
+    }
+    total += n;
+  }
+
+  *count = BLOCKS_FOR(total);
+  bzero(&buf[total], *count * BLKSIZE - total);
+  return total;
+}
+
+/* Bytes of a batch that made it to the entry */
+static int batch_bytes(const int n, const unsigned int count){
+  return (n < count * BLKSIZE) ? n : count * BLKSIZE;
+}
+
+/* Move the first block of a new file to a free run of count blocks, so
+   the rest of the batch follows it. Kept when the run already starts
+   there or there is none */
+static void first_run(struct inode * inode_ptr, const unsigned int count){
+  const unsigned int held = inode_ptr->dref[0];
+
+  if((count < 2) || (inode_ptr->total_ref != 1)){
+    return;
+  }
+  if((count <= meta->total_blocks - held) &&
+     (bits_find(bitlist, held + 1, held + count, 1) == held + count)){
+    return;
+  }
+  const unsigned int run = summary_run(count);
+  if(run == meta->total_blocks){
+    return;
+  }
+  bitlist_down(held);
+  bitlist_up(run);
+  inode_ptr->dref[0] = run;
+}
+
+/* Write data to entry */
+static int write_entry(struct entry * entry_ptr, const int fd){
+  unsigned int i = 0, j, count;
+  unsigned int blocks[BATCH_BLOCKS];
+  int n, done = 0;
+  struct inode * inode_ptr = &inodes[entry_ptr->inode];
+
+  unsigned char * buf = blkdev_alloc(BATCH_BLOCKS);
+  if(buf == NULL){
+    perror("blkdev_alloc");
+    return -1;
+  }
+
+  const unsigned int old_size = entry_ptr->size;
+  entry_ptr->size = 0;
+
+  do{
+    if((n = read_batch(fd, buf, &count)) < 0){
+      break;
+    }
+
+    if(i == 0){
+      first_run(inode_ptr, count);
+    }
+    for(j=0; j < count; j++, i++){
+      /* get another block, if we have filled the ones we hold */
+      if((i >= inode_ptr->total_ref) && (expand(inode_ptr) == -1)){
+        break;
+      }
+      blocks[j] = inode_block(inode_ptr, i);
+      csum_update(blocks[j], &buf[BLKSIZE * j]);
+    }
+
+    /* whole batch goes to the device at once */
+    if(blkdev->write_many(blocks, j, buf) == -1){
+      break;
+    }
+
+    /* increase entry size */
+    entry_ptr->size += batch_bytes(n, j);
+    if(j < count){
+      break;
+    }
+    done = (n < BATCH_BLOCKS * BLKSIZE);
+  }while(!done);
+
+  free(buf);
+  subtree_add(inode_ptr->parent, entry_ptr->size - old_size, 0, 0, 0);
+  tail_pack(entry_ptr);
+  /* stopped before the end of input, the file is incomplete */
+  return done ? (int) entry_ptr->size : -1;
+}
+
+/* Update entry data, rewriting only the blocks that differ from file */
+static int update_entry(struct entry * entry_ptr, const int fd){
+  unsigned int i = 0, j, count, stored, changed;
+  unsigned int blocks[BATCH_BLOCKS], written[BATCH_BLOCKS];
+  int n, same, done = 0;
+  unsigned int size = 0;
+  struct inode * inode_ptr = &inodes[entry_ptr->inode];
+
+  /* compare whole blocks, the tail goes back in one */
+  if(tail_unpack(inode_ptr) == -1){
+    return -1;
+  }
+
+  unsigned char * buf = blkdev_alloc(2 * BATCH_BLOCKS);
+  if(buf == NULL){
+    perror("blkdev_alloc");
+    tail_pack(entry_ptr);
+    return -1;
+  }
+  unsigned char * old = &buf[BATCH_BLOCKS * BLKSIZE];
+
+  do{
+    if((n = read_batch(fd, buf, &count)) < 0){
+      break;
+    }
+
+    /* stored blocks of this batch, read all at once to compare with */
+    stored = (i < inode_ptr->total_ref) ? inode_ptr->total_ref - i : 0;
+    stored = (stored < count) ? stored : count;
+    for(j=0; j < stored; j++){
+      blocks[j] = inode_block(inode_ptr, i + j);
+    }
+    same = (blkdev->read_many(blocks, stored, old) == 0);
+
+    /* changed blocks are packed at the front of buf */
+    for(j=0, changed=0; j < count; j++){
+      const int len = batch_bytes(n - j * BLKSIZE, 1);
+      unsigned char * block_ptr = &buf[BLKSIZE * j];
+      int block;
+
+      if(j < stored){
+        /* block is stored, compare before writing */
+        if(same && (memcmp(&old[BLKSIZE * j], block_ptr, len) == 0)){
+          continue;
+        }
+        block = blocks[j];
+      }else{
+        /* file has grown */
+        if((block = expand(inode_ptr)) == -1){
+          break;
+        }
+      }
+
+      csum_update(block, block_ptr);
+      if(changed != j){
+        memcpy(&buf[BLKSIZE * changed], block_ptr, BLKSIZE);
+      }
+      written[changed++] = block;
+    }
+
+    if(blkdev->write_many(written, changed, buf) == -1){
+      break;
+    }
+
+    size += batch_bytes(n, j);
+    i += j;
+    if(j < count){
+      break;
+    }
+    done = (n < BATCH_BLOCKS * BLKSIZE);
+  }while(!done);
+
+  free(buf);
+  /* a failed update keeps the old length, blocks past the written ones are unchanged */
+  if(!done && (entry_ptr->size > size)){
+    size = entry_ptr->size;
+  }
+  subtree_add(inode_ptr->parent, size - entry_ptr->size, 0, 0, 0);
+  entry_ptr->size = size;
+
+  /* file has shrunk, release blocks past its end (keep at least one) */
+  while((inode_ptr->total_ref > BLOCKS_FOR(size)) && (inode_ptr->total_ref > 1)){
+    shrink(inode_ptr);
+  }
+  tail_pack(entry_ptr);
+  return done ? (int) entry_ptr->size : -1;
+}
+
+/* Ask for blocks [first, last) of an inode to be read ahead, in runs */
+static void readahead_inode(const struct inode * inode_ptr, unsigned int first, unsigned int last){
+  unsigned int start, prev;
+
+  last = (last < inode_ptr->total_ref) ? last : inode_ptr->total_ref;
+  while(first < last){
+    start = prev = inode_block(inode_ptr, first);
+    for(first++; (first < last) && (inode_block(inode_ptr, first) == prev + 1); first++){
+      prev++;
+    }
+    advise_blocks(start, prev - start + 1, ADV_WILLNEED);
+  }
+}
+
+/* Read data from entry to file */
+static int entry_read(struct entry * entry_ptr, FILE * out){
+  unsigned int i, j, count, ahead = 0;
+  unsigned int blocks[BATCH_BLOCKS];
+  unsigned int size = entry_ptr->size;
+  struct inode * inode_ptr = &inodes[entry_ptr->inode];
+  const unsigned int batch = (blkdev->batch < BATCH_BLOCKS) ? blkdev->batch : BATCH_BLOCKS;
+
+  unsigned char * buf = blkdev_alloc(BATCH_BLOCKS);
+  if(buf == NULL){
+    perror("blkdev_alloc");
+    return -1;
+  }
+
+  for(i=0; i < inode_ptr->total_ref; i += count){
+    count = inode_ptr->total_ref - i;
+    count = (count < batch) ? count : batch;
+
+    /* keep the device busy with the blocks after this batch */
+    if(ahead < i + count + READAHEAD){
+      readahead_inode(inode_ptr, (ahead > i + count) ? ahead : i + count, i + count + READAHEAD);
+      ahead = i + count + READAHEAD;
+    }
+
+    /* read the batch all at once */
+    for(j=0; j < count; j++){
+      blocks[j] = inode_block(inode_ptr, i + j);
+    }
+    if(blkdev->read_many(blocks, count, buf) == -1){
+      free(buf);
+      return -1;
+    }
+
+    for(j=0; j < count; j++){
+      if(!csum_verify(blocks[j], &buf[BLKSIZE * j])){
+        fprintf(stderr, "Error: Checksum mismatch in block %u\n", blocks[j]);
+        free(buf);
+        return -1;
+      }
+    }
+
+    const unsigned int n = batch_bytes(size, count);
+    fwrite(buf, 1, n, out);
+    size -= n;
+  }
+
+  /* a packed tail is the rest */
+  if(inode_ptr->tail_len > 0){
+    const unsigned char * data = block_read(inode_ptr->tail_block, buf);
+    if((data == NULL) || !csum_verify(inode_ptr->tail_block, data)){
+      fprintf(stderr, "Error: Checksum mismatch in block %u\n", inode_ptr->tail_block);
+      free(buf);
+      return -1;
+    }
+    fwrite(&data[inode_ptr->tail_off], 1, inode_ptr->tail_len, out);
+  }
+
+  free(buf);
+  return 0;
+}
+
+
+/* Attribute records, packed one after another in an area */
+static struct xattr xattr_at(const unsigned char * area, const unsigned int size, const unsigned int off){
+  struct xattr rec = {0, 0, 0};
+  if(off + sizeof(rec) <= size){
+    memcpy(&rec, &area[off], sizeof(rec));
+  }
+  return rec;
+}
+
+static unsigned int xattr_size(const struct xattr rec){ return sizeof(rec) + rec.name_len + rec.value_len; }
+
+/* Offset where records of an area end */
+static unsigned int xattr_end(const unsigned char * area, const unsigned int size){
+  unsigned int off = 0;
+  struct xattr rec;
+
+  while(((rec = xattr_at(area, size, off)).name_len != 0) && (off + xattr_size(rec) <= size)){
+    off += xattr_size(rec);
+  }
+  return off;
+}
+
+/* Find the record of an owner by name, returns its offset or -1 */
+static int xattr_find(const unsigned char * area, const unsigned int size, const unsigned int inode, const char * name){
+  const size_t len = strlen(name);
+  const unsigned int end = xattr_end(area, size);
+  unsigned int off;
+  struct xattr rec;
+
+  for(off = 0; off < end; off += xattr_size(rec)){
+    rec = xattr_at(area, size, off);
+    if((rec.inode == inode) && (rec.name_len == len) && (memcmp(&area[off + sizeof(rec)], name, len) == 0)){
+      return off;
+    }
+  }
+  return -1;
+}
+
+/* Drop a record, moving the ones after it down */
+static void xattr_drop(unsigned char * area, const unsigned int size, const unsigned int off){
+  const unsigned int end = xattr_end(area, size);
+  const unsigned int len = xattr_size(xattr_at(area, size, off));
+
+  memmove(&area[off], &area[off + len], end - off - len);
+  bzero(&area[end - len], len);
+}
+
+/* Append a record, returns -1 if there is no room */
+static int xattr_put(unsigned char * area, const unsigned int size, const struct xattr rec, const char * name, const char * value){
+  const unsigned int end = xattr_end(area, size);
+
+  if(end + xattr_size(rec) > size){
+    return -1;
+  }
+  memcpy(&area[end], &rec, sizeof(rec));
+  memcpy(&area[end + sizeof(rec)], name, rec.name_len);
+  memcpy(&area[end + sizeof(rec) + rec.name_len], value, rec.value_len);
+  return 0;
+}
+
+/* Bytes taken by the records of an owner */
+static unsigned int xattr_owned(const unsigned char * area, const unsigned int size, const unsigned int inode){
+  const unsigned int end = xattr_end(area, size);
+  unsigned int off, owned = 0;
+  struct xattr rec;
+
+  for(off = 0; off < end; off += xattr_size(rec)){
+    rec = xattr_at(area, size, off);
+    owned += (rec.inode == inode) ? xattr_size(rec) : 0;
+  }
+  return owned;
+}
+
+/* Drop all records of an inode from its shared block, freeing the block
+   once nobody has records in it */
+static void xattr_unshare(const unsigned int inode){
+  const unsigned int block = inodes[inode].xattr_block;
+  unsigned int off = 0;
+  struct xattr rec;
+
+  if(block == 0){
+    return;
+  }
+  unsigned char * area = block_ref(block);
+  while((rec = xattr_at(area, BLKSIZE, off)).name_len != 0){
+    if(rec.inode == inode){
+      xattr_drop(area, BLKSIZE, off);
+    }else{
+      off += xattr_size(rec);
+    }
+  }
+
+  if(xattr_end(area, BLKSIZE) == 0){
+    bitlist_down(block);
+    if(meta->xattr_block == block){
+      meta->xattr_block = 0;
+    }
+  }
+  inodes[inode].xattr_block = 0;
+  subtree_blocks(&inodes[inode], -1);
+}
+
+static void xattr_clear(const unsigned int inode){
+  xattr_unshare(inode);
+  bzero(inodes[inode].xattr, XATTR_INLINE);
+}
+
+/* Move the shared records of an inode to a block with room for more bytes */
+static int xattr_spill(const unsigned int inode, const unsigned int more){
+  const unsigned int block = inodes[inode].xattr_block;
+  const unsigned int owned = block ? xattr_owned(block_ref(block), BLKSIZE, inode) : 0;
+  unsigned int target = meta->xattr_block;
+  unsigned int off;
+  struct xattr rec;
+
+  if(owned + more > BLKSIZE){
+    fprintf(stderr, "Error: Attributes of inode %u don't fit a block\n", inode);
+    return -1;
+  }
+  /* a first spill is charged like any other block */
+  if((block == 0) && (inode != 0) && (quota_check(inodes[inode].parent, 1, 0) == -1)){
+    return -1;
+  }
+
+  /* the current shared block, or a fresh one */
+  if((target == 0) || (target == block) || (xattr_end(block_ref(target), BLKSIZE) + owned + more > BLKSIZE)){
+    target = get_data_block(0);
+    if(target == meta->total_blocks){
+      fprintf(stderr, "Error: No free block for attributes\n");
+      return -1;
+    }
+    bzero(block_ref(target), BLKSIZE);
+    meta->xattr_block = target;
+  }
+
+  if(block){
+    const unsigned char * area = block_ref(block);
+    for(off = 0; (rec = xattr_at(area, BLKSIZE, off)).name_len != 0; off += xattr_size(rec)){
+      if(rec.inode == inode){
+        const char * name = (const char *) &area[off + sizeof(rec)];
+        xattr_put(block_ref(target), BLKSIZE, rec, name, name + rec.name_len);
+      }
+    }
+    xattr_unshare(inode);
+  }
+  inodes[inode].xattr_block = target;
+  subtree_blocks(&inodes[inode], 1);
+  return 0;
+}
+
+/* Set an attribute, inline if it fits. A NULL value removes it */
+static int xattr_set(const unsigned int inode, const char * name, const char * value){
+  struct inode * inode_ptr = &inodes[inode];
+  const struct xattr rec = {inode, strlen(name), value ? strlen(value) : 0};
+  int off;
+
+  if((strlen(name) == 0) || (strlen(name) > 255) || (value && (strlen(value) > 255))){
+    fprintf(stderr, "Error: Attribute name and value take 1 to 255 bytes\n");
+    return -1;
+  }
+  if(xattr_size(rec) > BLKSIZE){
+    fprintf(stderr, "Error: Attribute is bigger than a block\n");
+    return -1;
+  }
+
+  if((off = xattr_find(inode_ptr->xattr, XATTR_INLINE, inode, name)) >= 0){
+    xattr_drop(inode_ptr->xattr, XATTR_INLINE, off);
+  }else if(inode_ptr->xattr_block){
+    unsigned char * area = block_ref(inode_ptr->xattr_block);
+    if((off = xattr_find(area, BLKSIZE, inode, name)) >= 0){
+      xattr_drop(area, BLKSIZE, off);
+    }
+    if(xattr_owned(area, BLKSIZE, inode) == 0){
+      xattr_unshare(inode);
+    }
+  }
+
+  if((value == NULL) || (xattr_put(inode_ptr->xattr, XATTR_INLINE, rec, name, value) == 0)){
+    return 0;
+  }
+
+  /* spill into the shared block, moving to another one if it is full */
+  if((inode_ptr->xattr_block == 0) || (xattr_put(block_ref(inode_ptr->xattr_block), BLKSIZE, rec, name, value) == -1)){
+    if(xattr_spill(inode, xattr_size(rec)) == -1){
+      return -1;
+    }
+    return xattr_put(block_ref(inode_ptr->xattr_block), BLKSIZE, rec, name, value);
+  }
+  return 0;
+}
+
+/* Print attributes of an inode in an area, all or the one named */
+static int xattr_print(const unsigned char * area, const unsigned int size, const unsigned int inode, const char * name){
+  const unsigned int end = xattr_end(area, size);
+  unsigned int off;
+  int found = 0;
+  struct xattr rec;
+
+  for(off = 0; off < end; off += xattr_size(rec)){
+    rec = xattr_at(area, size, off);
+    const char * rec_name = (const char *) &area[off + sizeof(rec)];
+    if(rec.inode != inode){
+      continue;
+    }
+    if(name == NULL){
+      printf("%.*s=%.*s\n", rec.name_len, rec_name, rec.value_len, rec_name + rec.name_len);
+      found++;
+    }else if((rec.name_len == strlen(name)) && (memcmp(rec_name, name, rec.name_len) == 0)){
+      printf("%.*s\n", rec.value_len, rec_name + rec.name_len);
+      return 1;
+    }
+  }
+  return found;
+}
+
+/* Remove entry from a directory */
+static void entry_remove(struct entry * entry_ptr){
+
+  struct inode * inode_ptr = &inodes[entry_ptr->inode];
+  const int file = (entry_ptr->type == E_FILE);
+  const unsigned int dir = inode_ptr->parent;
+
+  if(index_enabled()){
+    index_remove(entry_ptr->name, entry_ptr->inode);
+  }
+
+  xattr_clear(entry_ptr->inode);
+  tail_release(inode_ptr);
+
+  /* take it out of the totals above */
+  subtree_add(dir, file ? -(int) entry_ptr->size : 0, -(int) inode_blocks(inode_ptr), -file, file - 1);
+
+  /* release the data blocks hold by inode, a run at a time */
+  unsigned int run = 0, len = 0;
+  FOREACH_BLOCK(inode_ptr)
+    if((len > 0) && (block == run + len)){
+      len++;
+      continue;
+    }
+    bitlist_fill(run, len, 0);
+    run = block;
+    len = 1;
+  }
+  bitlist_fill(run, len, 0);
+
+  if(inode_ptr->iref > 0){
+    /* release indirect data block hold by inode */
+    bitlist_down(inode_ptr->iref);
+  }
+
+  /* zero out entry and inode memory */
   bzero(inode_ptr, sizeof(struct inode));
-  bzero(entry_ptr, sizeof(struct entry));
+
+  /* sorted directories close the gap instead */
+  if(dirs_sorted()){
+    struct inode * dir_ptr = &inodes[dir];
+    const unsigned int end = entry_end(dir_ptr);
+    unsigned int k;
+
+    for(k = entry_bound(dir_ptr, entry_ptr->name, NAMESIZE) + 1; k < end; k++){
+      *entry_at(dir_ptr, k - 1) = *entry_at(dir_ptr, k);
+    }
+    bzero(entry_at(dir_ptr, end - 1), sizeof(struct entry));
+  }else{
+    bzero(entry_ptr, sizeof(struct entry));
+  }
+}
+
+/* Returns number of entries in a directory */
+static int entry_count(struct inode *inode_ptr){
+  int n = 0;
+  FOREACH_ENTRY(inode_ptr){
+      if(entry_ptr->inode != 0){
+        ++n;
+      }
+    }
+  }
+  return n;
+}
+
+/* Remove entry by following a path */
+static void entry_remove_path(struct inode * inode_ptr, char * path){
+
+  /* On first call, it will load path to strtok, on next it will give subdirs */
+  const char * name = strtok(path, "/");
+  if(name == NULL){
+    return;
+  }
+
+  struct entry * entry_ptr = search_entry(inode_ptr, name);
+  if(entry_ptr == NULL){
+    fprintf(stderr, "Error: Entry '%s' not found\n", name);
+    return;
+  }
+
+  if(entry_ptr->type == E_DIR){ /* if its a subdir */
+    struct inode * einode_ptr = &inodes[entry_ptr->inode];
+    /* recurse into the directory */
+    entry_remove_path(einode_ptr, NULL);
+
+    if(entry_count(einode_ptr) == 0){ /* if dir is empry after file deleted */
+      entry_remove(entry_ptr);    /* remove it */
+    }
+
+  }else if(entry_ptr->type == E_FILE){
+    entry_remove(entry_ptr);
+  }
+}
+
+/* Find entry by following a path */
+static struct entry* entry_lookup(char * path){
+  //start from root directory
+  struct inode * inode_ptr = &inodes[0];
+  struct entry * entry_ptr = NULL;
+
+  /* go down the path to file */
+  char * name = strtok(path, "/");
+  while(name){
+
+    /* search for the name in this directory */
+    entry_ptr = search_entry(inode_ptr, name);
+    if(entry_ptr == NULL){
+      return NULL;
+    }
+
+    name = strtok(NULL, "/");
+    if(entry_ptr->type == E_DIR){
+      /* go to next directory */
+      inode_ptr = &inodes[entry_ptr->inode];
+    }else if(name){
+      /* a file can't hold the rest of the path */
+      return NULL;
+    }
+  }
+  return entry_ptr;
+}
+
+/* List entries in a directory */
+static void entry_list(struct inode * inode_ptr, const int level){
+
+  FOREACH_ENTRY(inode_ptr){
+      if(entry_ptr->inode == 0){
+        continue;
+      }
+
+      print_indent(level);
+
+      switch(entry_ptr->type){
+        case E_FILE:
+          printf("'%s' %d\n", entry_ptr->name, entry_ptr->size);
+          break;
+        case E_DIR:
+          printf("directory '%s':\n", entry_ptr->name);
+          entry_list(&inodes[entry_ptr->inode], level+1);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+#define OUTBUF_SIZE (1 << 20)
+#define RECORD_MAX  (6 * PATH_MAX + 128)  /* longest record, a fully escaped path */
+
+struct outbuf {  // buffered writer for listings
+  int    fd;
+  size_t len;
+  pthread_mutex_t * lock;  //shared by writers on other threads, or NULL
+  char   data[OUTBUF_SIZE];
+};
+
+/* Write buffered output */
+static void out_flush(struct outbuf * out){
+  size_t done = 0;
+
+  if(out->lock){
+    pthread_mutex_lock(out->lock);
+  }
+
+  while(done < out->len){
+    const ssize_t n = write(out->fd, &out->data[done], out->len - done);
+    if(n < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("write");
+      break;
+    }
+    done += n;
+  }
+  if(out->lock){
+    pthread_mutex_unlock(out->lock);
+  }
+  out->len = 0;
+}
+
+static void out_put(struct outbuf * out, const char * data, size_t len){
+  if(out->len + len > OUTBUF_SIZE){
+    out_flush(out);
+  }
+  memcpy(&out->data[out->len], data, len);
+  out->len += len;
+}
+
+static void out_str(struct outbuf * out, const char * str){
+  out_put(out, str, strlen(str));
+}
+
+static void out_uint(struct outbuf * out, unsigned long long n){
+  char digits[24];
+  int i = sizeof(digits);
+
+  do{
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  }while(n > 0);
+  out_put(out, &digits[i], sizeof(digits) - i);
+}
+
+/* Write a string as JSON, with quotes and escapes */
+static void out_json(struct outbuf * out, const char * str){
+  static const char hex[] = "0123456789abcdef";
+  const char * run = str;
+
+  out_put(out, "\"", 1);
+  for(; *str; str++){
+    const unsigned char c = *str;
+    if((c >= 0x20) && (c != '"') && (c != '\\')){
+      continue;
+    }
+
+    /* copy the plain run before, then the escape */
+    out_put(out, run, str - run);
+    run = str + 1;
+    switch(c){
+      case '"':  out_put(out, "\\\"", 2); break;
+      case '\\': out_put(out, "\\\\", 2); break;
+      case '\n': out_put(out, "\\n", 2);  break;
+      case '\t': out_put(out, "\\t", 2);  break;
+      default: {
+        const char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+        out_put(out, esc, sizeof(esc));
+      }
+    }
+  }
+  out_put(out, run, str - run);
+  out_put(out, "\"", 1);
+}
+
+/* Write one listing record, whole so writers can share an fd */
+static void out_entry(struct outbuf * out, const int format, const char * path, const struct entry * entry_ptr){
+  const unsigned int blocks = inode_blocks(&inodes[entry_ptr->inode]);
+  const int dir = (entry_ptr->type == E_DIR);
+
+  if(out->len + RECORD_MAX > OUTBUF_SIZE){
+    out_flush(out);
+  }
+
+  if(format == LIST_JSON){
+    out_str(out, "{\"path\":");
+    out_json(out, path);
+    out_str(out, ",\"size\":");
+    out_uint(out, entry_ptr->size);
+    out_str(out, ",\"inode\":");
+    out_uint(out, entry_ptr->inode);
+    out_str(out, dir ? ",\"type\":\"dir\"" : ",\"type\":\"file\"");
+    out_str(out, ",\"blocks\":");
+    out_uint(out, blocks);
+    out_str(out, "}\n");
+  }else if(format == LIST_PATH){
+    out_put(out, path, strlen(path));
+    out_put(out, "\n", 1);
+  }else{
+    /* path, size, inode, type and blocks, each ended by a NUL */
+    out_put(out, path, strlen(path) + 1);
+    out_uint(out, entry_ptr->size);
+    out_put(out, "", 1);
+    out_uint(out, entry_ptr->inode);
+    out_put(out, "", 1);
+    out_put(out, dir ? "d" : "f", 2);
+    out_uint(out, blocks);
+    out_put(out, "", 1);
+  }
+}
+
+struct walk_dir {  // directory reached by the tree walker
+  char *       path;
+  unsigned int parent;       //inode of parent directory
+  unsigned long long bytes;  //subtree totals, directory included
+  unsigned int blocks;
+  unsigned int files;
+  unsigned int dirs;
+};
+
+struct walk_queue {  // directories waiting on one thread, stolen from the head
+  pthread_mutex_t lock;
+  unsigned int    head;
+  unsigned int    tail;
+  unsigned int    items[TOTAL_INODES];  //a directory is queued once
+};
+
+struct walker {  // state shared by walker threads
+  unsigned int        root;
+  int                 format;   //record format, or -1 for none
+  const struct find_query * query;  //records only for matches, or NULL
+  size_t              literal;  //length of pattern before a wildcard
+  int                 threads;
+  unsigned int        pending;  //directories queued or being walked
+  unsigned char       seen[TOTAL_INODES];
+  struct walk_dir     dirs[TOTAL_INODES];
+  struct walk_queue * queues;
+  pthread_mutex_t     out_lock;
+};
+
+struct walk_job {  // work given to each walker thread
+  struct walker * walk;
+  int             id;
+  struct outbuf * out;
+};
+
+static void walk_push(struct walk_queue * queue, const unsigned int n){
+  pthread_mutex_lock(&queue->lock);
+  queue->items[queue->tail++ % TOTAL_INODES] = n;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* Take a directory, own queue from the tail, others from the head */
+static int walk_take(struct walker * walk, const int id, unsigned int * n){
+  int t;
+
+  for(t=0; t < walk->threads; t++){
+    struct walk_queue * queue = &walk->queues[(id + t) % walk->threads];
+    int found = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->head != queue->tail){
+      *n = (t == 0) ? queue->items[--queue->tail % TOTAL_INODES]
+                    : queue->items[queue->head++ % TOTAL_INODES];
+      found = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if(found){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Entry matches all predicates of a find query */
+static int find_match(const struct walker * walk, const char * path, const struct entry * entry_ptr){
+  const struct find_query * query = walk->query;
+
+  if(query->type && (query->type != ((entry_ptr->type == E_DIR) ? 'd' : 'f'))){
+    return 0;
+  }
+  switch(query->size_op){
+    case '<': if(entry_ptr->size >= query->size){ return 0; } break;
+    case '>': if(entry_ptr->size <= query->size){ return 0; } break;
+    case '=': if(entry_ptr->size != query->size){ return 0; } break;
+    default: break;
+  }
+
+  /* a pattern with no slash is for the name alone */
+  if(strchr(query->pattern, '/') == NULL){
+    const char * name = strrchr(path, '/');
+    return fnmatch(query->pattern, name ? name + 1 : path, 0) == 0;
+  }
+  return fnmatch(query->pattern, path, 0) == 0;
+}
+
+/* Something below a directory could match the literal part of the pattern */
+static int find_descend(const struct walker * walk, const char * path){
+  const size_t len = strlen(path);
+
+  if(strchr(walk->query->pattern, '/') == NULL){
+    return 1;
+  }
+  /* path and literal agree as far as both go, with a slash after path */
+  if(len >= walk->literal){
+    return strncmp(path, walk->query->pattern, walk->literal) == 0;
+  }
+  return (strncmp(path, walk->query->pattern, len) == 0) && (walk->query->pattern[len] == '/');
+}
+
+/* One entry of directory n: put its name after path, print it if it
+   matches, add it to the directory sums and queue it if it is a subdirectory */
+static void walk_entry(struct walk_job * job, const unsigned int n, char * path, const size_t len,
+                       const struct entry * entry_ptr, struct walk_dir * sums){
+  struct walker * walk = job->walk;
+  const unsigned int child = entry_ptr->inode;
+
+  if((child == 0) || (child >= TOTAL_INODES)){
+    return;
+  }
+
+  const size_t name_len = strnlen(entry_ptr->name, NAMESIZE);
+  if(len + 1 + name_len >= PATH_MAX){
+    fprintf(stderr, "Error: Path too long under '%s'\n", walk->dirs[n].path);
+    return;
+  }
+  path[len] = '/';
+  memcpy(&path[len + 1], entry_ptr->name, name_len);
+  path[len + 1 + name_len] = '\0';
+
+  if((walk->format >= 0) && ((walk->query == NULL) || find_match(walk, path, entry_ptr))){
+    out_entry(job->out, walk->format, path, entry_ptr);
+  }
+
+  if(entry_ptr->type == E_FILE){
+    sums->bytes  += entry_ptr->size;
+    sums->blocks += inode_blocks(&inodes[child]);
+    sums->files++;
+  }else if(entry_ptr->type == E_DIR){
+    sums->dirs++;
+    if(walk->query && !find_descend(walk, path)){
+      return;
+    }
+    /* a damaged image may link a directory twice, or hold bad references */
+    if(!inode_walkable(&inodes[child]) || __atomic_exchange_n(&walk->seen[child], 1, __ATOMIC_RELAXED)){
+      return;
+    }
+    walk->dirs[child].path   = strdup(path);
+    walk->dirs[child].parent = n;
+    if(walk->dirs[child].path == NULL){
+      perror("strdup");
+      return;
+    }
+    __atomic_add_fetch(&walk->pending, 1, __ATOMIC_RELAXED);
+    walk_push(&walk->queues[job->id], child);
+  }
+}
+
+/* Name prefix every match below a directory must have, from the literal
+   part of a find pattern. Returns its length, 0 when any name can match */
+static size_t find_prefix(const struct walker * walk, const char * path, const size_t len, const char ** prefix){
+  const char * pattern = walk->query->pattern;
+
+  if((walk->literal <= len + 1) || (strncmp(pattern, path, len) != 0) || (pattern[len] != '/')){
+    return 0;
+  }
+  *prefix = &pattern[len + 1];
+  const char * end = memchr(*prefix, '/', walk->literal - len - 1);
+  return end ? (size_t) (end - *prefix) : walk->literal - len - 1;
+}
+
+/* Walk the entries of a directory, queueing subdirectories */
+static void walk_dir(struct walk_job * job, const unsigned int n){
+  struct walker * walk = job->walk;
+  struct walk_dir * dir = &walk->dirs[n];
+  struct walk_dir sums = {NULL, 0, 0, inode_blocks(&inodes[n]), 0, 0};
+  struct inode * inode_ptr = &inodes[n];
+  char path[PATH_MAX];
+  const char * prefix = NULL;
+  unsigned int p, k;
+  const size_t len = strlen(dir->path);
+  size_t prefix_len = 0;
+
+  memcpy(path, dir->path, len);
+  path[len] = '\0';
+
+  /* sorted directories hold the names with a prefix together */
+  if(dirs_sorted() && walk->query && strchr(walk->query->pattern, '/')){
+    prefix_len = find_prefix(walk, path, len, &prefix);
+  }
+
+  if(prefix_len > 0){
+    for(k = entry_bound(inode_ptr, prefix, prefix_len); k < dir_slots(inode_ptr); k++){
+      const struct entry * entry_ptr = entry_at(inode_ptr, k);
+      if(strncmp(entry_ptr->name, prefix, prefix_len) != 0){
+        break;
+      }
+      walk_entry(job, n, path, len, entry_ptr, &sums);
+    }
+  }else{
+    FOREACH_ENTRY(inode_ptr){
+        walk_entry(job, n, path, len, entry_ptr, &sums);
+      }
+    }
+  }
+
+  /* add to totals of this directory and all above it */
+  for(p = n;; p = walk->dirs[p].parent){
+    struct walk_dir * up = &walk->dirs[p];
+    __atomic_add_fetch(&up->bytes,  sums.bytes,  __ATOMIC_RELAXED);
+    __atomic_add_fetch(&up->blocks, sums.blocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&up->files,  sums.files,  __ATOMIC_RELAXED);
+    __atomic_add_fetch(&up->dirs,   sums.dirs,   __ATOMIC_RELAXED);
+    if(p == walk->root){
+      break;
+    }
+  }
+}
+
+static void * walk_thread(void * arg){
+  struct walk_job * job = arg;
+  struct walker * walk = job->walk;
+  unsigned int n;
+
+  while(__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) > 0){
+    if(!walk_take(walk, job->id, &n)){
+      sched_yield();
+      continue;
+    }
+    walk_dir(job, n);
+    __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_RELEASE);
+  }
+  if(job->out){
+    out_flush(job->out);
+  }
+  return NULL;
+}
+
+/* Walk the tree below a directory on several threads, records go to stdout
+   in no particular order. Returns the walker for its totals, or NULL */
+static struct walker * walk_tree(const unsigned int root, const char * path, const int format,
+                                 const struct find_query * query, int threads){
+  int t;
+
+  if(threads < 1){
+    threads = 1;
+  }
+  if(threads > TOTAL_INODES){
+    threads = TOTAL_INODES;
+  }
+
+  struct walker * walk = calloc(1, sizeof(struct walker));
+  struct walk_job * jobs = calloc(threads, sizeof(struct walk_job));
+  if(walk == NULL || jobs == NULL){
+    perror("calloc");
+    free(walk);
+    free(jobs);
+    return NULL;
+  }
+  walk->queues = calloc(threads, sizeof(struct walk_queue));
+  if(walk->queues == NULL){
+    perror("calloc");
+    free(walk);
+    free(jobs);
+    return NULL;
+  }
+  walk->root    = root;
+  walk->format  = format;
+  walk->query   = query;
+  walk->literal = query ? strcspn(query->pattern, "*?[\\") : 0;
+  walk->threads = threads;
+  walk->pending = 1;
+  walk->seen[root] = 1;
+  walk->dirs[root].path   = strdup(path);
+  walk->dirs[root].parent = root;
+  pthread_mutex_init(&walk->out_lock, NULL);
+  for(t=0; t < threads; t++){
+    pthread_mutex_init(&walk->queues[t].lock, NULL);
+  }
+  walk_push(&walk->queues[0], root);
+
+  /* stdout may hold text from earlier commands */
+  fflush(stdout);
+
+  pthread_t tids[threads];
+  int started[threads];
+  for(t=0; t < threads; t++){
+    jobs[t].walk = walk;
+    jobs[t].id   = t;
+    if(walk->format >= 0){
+      jobs[t].out = malloc(sizeof(struct outbuf));
+      if(jobs[t].out == NULL){
+        perror("malloc");
+        walk->format = -1;
+      }else{
+        jobs[t].out->fd   = STDOUT_FILENO;
+        jobs[t].out->len  = 0;
+        jobs[t].out->lock = &walk->out_lock;
+      }
+    }
+    /* without a thread, the job runs here */
+    started[t] = (pthread_create(&tids[t], NULL, walk_thread, &jobs[t]) == 0);
+    if(!started[t]){
+      walk_thread(&jobs[t]);
+    }
+  }
+
+  for(t=0; t < threads; t++){
+    if(started[t]){
+      pthread_join(tids[t], NULL);
+    }
+    free(jobs[t].out);
+  }
+  free(jobs);
+  return walk;
+}
+
+static void walk_free(struct walker * walk){
+  int n;
+  for(n=0; n < TOTAL_INODES; n++){
+    free(walk->dirs[n].path);
+  }
+  free(walk->queues);
+  free(walk);
+}
+
+static void recover();
+
+void mapfs(int fd, int backend, int hints){
+  blkdev_open(fd, backend, hints);
+}
+
+
+void unmapfs(){
+  /* everything else is on the image before it is marked clean */
+  if(meta != NULL){
+    blkdev->sync();
+    meta->clean = 1;
+  }
+  blkdev->close();
+}
+
+void setup_sectors(struct metadata * meta_ptr){
+  meta_ptr->magic        = FS_MAGIC;
+  meta_ptr->version      = FS_VERSION;
+  meta_ptr->total_blocks = TOTAL_BLOCKS;
+  meta_ptr->total_inodes = TOTAL_INODES;
+  meta_ptr->block_bytes  = BLKSIZE;
+
+  // superblock takes 1 block
+  meta_ptr->sectors[SUPER].sector_start = 0;
+  meta_ptr->sectors[SUPER].sector_size = 1;
+
+  // bitmap takes 1 bit for each block, its summary levels follow
+  meta_ptr->sectors[FREELIST].sector_start = meta_ptr->sectors[SUPER].sector_size;
+  meta_ptr->sectors[FREELIST].sector_size = BLOCKS_FOR(summary_layout(TOTAL_BLOCKS, NULL, NULL) * sizeof(unsigned long long));
+
+  //inodes are 100
+  meta_ptr->sectors[INODES].sector_start = meta_ptr->sectors[FREELIST].sector_start + meta_ptr->sectors[FREELIST].sector_size;
+  meta_ptr->sectors[INODES].sector_size  = BLOCKS_FOR(TOTAL_INODES * sizeof(struct inode));
+
+  // checksums take a crc32c for each block
+  meta_ptr->sectors[CHECKSUMS].sector_start = meta_ptr->sectors[INODES].sector_start + meta_ptr->sectors[INODES].sector_size;
+  meta_ptr->sectors[CHECKSUMS].sector_size  = BLOCKS_FOR(TOTAL_BLOCKS * sizeof(unsigned int));
+
+  // name index, a hash table kept when FEATURE_NAME_INDEX is set
+  meta_ptr->sectors[NAMES].sector_start = meta_ptr->sectors[CHECKSUMS].sector_start + meta_ptr->sectors[CHECKSUMS].sector_size;
+  meta_ptr->sectors[NAMES].sector_size  = BLOCKS_FOR(INDEX_SLOTS * sizeof(struct name_slot));
+
+  //data is at end
+  meta_ptr->sectors[DATA].sector_start = meta_ptr->sectors[NAMES].sector_start + meta_ptr->sectors[NAMES].sector_size;
+  meta_ptr->sectors[DATA].sector_size  = meta_ptr->total_blocks - meta_ptr->sectors[DATA].sector_start;
+}
+
+static void create_root(){
+  struct inode * inode_ptr = &inodes[0];
+  const int block = expand(inode_ptr);
+  struct entry * entry_ptr = (struct entry *)block_ref(block);
+
+  entry_name(entry_ptr, "/");
+  entry_ptr->type   = E_DIR;
+  entry_ptr->inode  = 0;
+  entry_ptr->size   = 0;
+}
+
+void formatfs(int features){
+  blkdev->zero();
+
+  /* save metadata info*/
+  meta = (struct metadata*) block_ref(0);
+
+  setup_sectors(meta);
+  meta->features = features;
+  loadfs(0);
+
+  /* setup system blocks as used in bit list, they come before the data */
+  bits_fill(bitlist, 0, meta->sectors[DATA].sector_start, 1);
+  summary_build();
+
+  /* create the / directory */
+  create_root();
+  meta->clean = 1;
+}
+
+
+void loadfs(int recovery){
+  meta    = (struct metadata*) block_ref(0);
+
+  if((meta->magic != FS_MAGIC) || (meta->version != FS_VERSION) || (meta->block_bytes != BLKSIZE)){
+    fprintf(stderr, "Error: Unsupported filesystem image\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* superblock, free list and inodes stay resident. Checksums and the
+     name index are read through the cache like data, as they are used */
+  blkdev->pin(meta->sectors[CHECKSUMS].sector_start);
+
+  meta    = (struct metadata*) block_ref(0);
+  bitlist = (unsigned char*) block_ref(meta->sectors[FREELIST].sector_start);
+  inodes  = (struct inode*)  block_ref(meta->sectors[INODES].sector_start);
+
+  /* summary levels follow each other after the bit list */
+  unsigned int k;
+  summary_layout(meta->total_blocks, level_bits, &levels);
+  level[0] = (unsigned long long*) bitlist;
+  for(k = 1; k < levels; k++){
+    level[k] = level[k - 1] + words_for(level_bits[k - 1]);
+  }
+
+  /* everything is kept on the image, only a crash leaves it to rebuild */
+  if(!meta->clean && recovery){
+    recover();
+  }
+  /* on the image now, so a crash before unmapfs() is seen on next open */
+  meta->clean = 0;
+  blkdev->sync();
+}
+
+void lsfs(){
+  struct inode * inode_ptr = &inodes[0];
+  entry_list(inode_ptr, 0);
+
+  blkdev->release();
+}
+
+
+void listfs(int format, int threads){
+  struct walker * walk = walk_tree(0, "", format, NULL, threads);
+  if(walk){
+    walk_free(walk);
+  }
+
+  blkdev->release();
+}
+
+void findfs(const struct find_query * query, int threads){
+  struct find_query rooted = *query;
+  char pattern[PATH_MAX];
+
+  /* paths are matched from the root */
+  if(strchr(query->pattern, '/') && (query->pattern[0] != '/')){
+    snprintf(pattern, sizeof(pattern), "/%s", query->pattern);
+    rooted.pattern = pattern;
+  }
+
+  struct walker * walk = walk_tree(0, "", LIST_PATH, &rooted, threads);
+  if(walk){
+    walk_free(walk);
+  }
+
+  blkdev->release();
+}
+
+/* Find the entry of an inode in a directory */
+static struct entry * entry_of(const unsigned int dir, const unsigned int inode){
+  /* values come from the image, a damaged one may hold anything */
+  if((dir >= TOTAL_INODES) || (inode >= TOTAL_INODES) || !inode_walkable(&inodes[dir])){
+    return NULL;
+  }
+  struct inode * inode_ptr = &inodes[dir];
+
+  FOREACH_ENTRY(inode_ptr){
+      if(entry_ptr->inode == inode){
+        return entry_ptr;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Build the path of an inode from its parent links */
+static int inode_path(unsigned int inode, char * path){
+  char buf[PATH_MAX];
+  size_t pos = sizeof(buf) - 1;
+  int depth;
+
+  buf[pos] = '\0';
+  for(depth=0; (inode != 0) && (depth < TOTAL_INODES); depth++){
+    const struct entry * entry_ptr = entry_of(inodes[inode].parent, inode);
+    if(entry_ptr == NULL){
+      return -1;
+    }
+    const size_t len = strnlen(entry_ptr->name, NAMESIZE);
+    if(len + 1 > pos){
+      return -1;
+    }
+    pos -= len;
+    memcpy(&buf[pos], entry_ptr->name, len);
+    buf[--pos] = '/';
+    inode = inodes[inode].parent;
+  }
+  memcpy(path, &buf[pos], sizeof(buf) - pos);
+  return 0;
+}
+
+/* Print the path of an index record, if its name starts with prefix */
+static void index_print(const struct name_slot * slot, const char * prefix, const size_t len, const int exact){
+  char path[PATH_MAX];
+
+  /* the head settles short prefixes, the entry settles the rest */
+  if((slot->inode >= TOTAL_INODES) || (slot->parent >= TOTAL_INODES) ||
+     (strncmp(slot->head, prefix, (len < INDEX_HEAD) ? len : INDEX_HEAD) != 0)){
+    return;
+  }
+  const struct entry * entry_ptr = entry_of(slot->parent, slot->inode);
+  if((entry_ptr == NULL) || (strncmp(entry_ptr->name, prefix, len) != 0) ||
+     (exact && (strnlen(entry_ptr->name, NAMESIZE) != len))){
+    return;
+  }
+  if(inode_path(slot->inode, path) == 0){
+    printf("%s\n", path);
+  }
+}
+
+void namefs(char * name){
+  unsigned int i;
+  size_t len = strlen(name);
+
+  if(!index_enabled()){
+    fprintf(stderr, "Error: Image has no name index\n");
+    blkdev->release();
+    return;
+  }
+
+  if((len > 0) && (name[len - 1] == '*')){
+    /* prefix, every record is a candidate */
+    name[--len] = '\0';
+    for(i=0; i < INDEX_SLOTS; i++){
+      const struct name_slot * slot = index_slot(NULL, i);
+      if(slot->inode != 0){
+        index_print(slot, name, len, 0);
+      }
+    }
+  }else{
+    /* exact name, probe from its hash */
+    const unsigned int hash = name_hash(name, len);
+    for(i = hash & (INDEX_SLOTS - 1); index_slot(NULL, i)->inode != 0; i = (i + 1) & (INDEX_SLOTS - 1)){
+      if(index_slot(NULL, i)->hash == hash){
+        index_print(index_slot(NULL, i), name, len, 1);
+      }
+    }
+  }
+
+  blkdev->release();
+}
+
+/* Order directories by path */
+static int dir_cmp(const void * a, const void * b){
+  return strcmp((*(const struct walk_dir **) a)->path, (*(const struct walk_dir **) b)->path);
+}
+
+void dufs(char * path, int threads){
+  struct inode * inode_ptr = &inodes[0];
+  unsigned int root = 0;
+  char prefix[PATH_MAX];
+  int n, count = 0;
+
+  /* paths are printed from the root, without a trailing slash */
+  snprintf(prefix, sizeof(prefix), "%s%s", (path[0] == '/') ? "" : "/", path);
+  for(n = strlen(prefix); (n > 0) && (prefix[n - 1] == '/'); n--){
+    prefix[n - 1] = '\0';
+  }
+
+  /* an empty path is the root directory */
+  if(prefix[0]){
+    struct entry * entry_ptr = entry_lookup(path);
+    if(entry_ptr == NULL){
+      fprintf(stderr, "Error: Entry not found\n");
+      blkdev->release();
+      return;
+    }
+    inode_ptr = &inodes[entry_ptr->inode];
+    if(entry_ptr->type == E_FILE){
+      printf("%u\t%u\t1\t0\t%s\n", entry_ptr->size, inode_blocks(inode_ptr), prefix);
+      blkdev->release();
+      return;
+    }
+    root = entry_ptr->inode;
+  }
+
+  /* the walk finds the directories, their totals are the ones kept */
+  struct walker * walk = walk_tree(root, prefix, -1, NULL, threads);
+  if(walk == NULL){
+    blkdev->release();
+    return;
+  }
+
+  /* one line per directory, sorted by path */
+  struct walk_dir * dirs[TOTAL_INODES];
+  for(n=0; n < TOTAL_INODES; n++){
+    if(walk->dirs[n].path){
+      dirs[count++] = &walk->dirs[n];
+    }
+  }
+  qsort(dirs, count, sizeof(dirs[0]), dir_cmp);
+  for(n=0; n < count; n++){
+    /* own blocks of a directory are not in its totals */
+    inode_ptr = &inodes[dirs[n] - walk->dirs];
+    const struct subtree * tree = &inode_ptr->tree;
+    printf("%u\t%u\t%u\t%u\t%s\n", tree->bytes, tree->blocks + inode_blocks(inode_ptr), tree->files, tree->dirs,
+           dirs[n]->path[0] ? dirs[n]->path : "/");
+  }
+
+  walk_free(walk);
+  blkdev->release();
+}
+
+/* Blocks a file of some size takes, with its indirect block */
+static unsigned int file_blocks(const off_t size){
+  const unsigned int blocks = (size > 0) ? BLOCKS_FOR(size) : 1;
+  return blocks + (blocks > DREFSIZE);
+}
+
+/* Check quotas for adding a file by path, before anything is stored */
+static int add_check(const char * fname, const int fd){
+  struct stat st;
+  unsigned int dir = 0, missing = 0;
+
+  /* pipes and devices are checked as they are written */
+  if((fstat(fd, &st) == -1) || !S_ISREG(st.st_mode)){
+    return 0;
+  }
+
+  char * path = strdup(fname);
+  if(path == NULL){
+    return 0;
+  }
+
+  /* find the last directory stored, the rest is created */
+  char * name = strtok(path, "/");
+  while(name){
+    struct entry * entry_ptr = missing ? NULL : search_entry(&inodes[dir], name);
+    if((entry_ptr != NULL) && (entry_ptr->type == E_DIR)){
+      dir = entry_ptr->inode;
+    }else{
+      missing++;
+    }
+    name = strtok(NULL, "/");
+  }
+  free(path);
+
+  if(missing == 0){
+    return 0;
+  }
+  /* new directories take a block each */
+  return quota_check(dir, file_blocks(st.st_size) + missing - 1, missing);
 }
 
-/* Returns number of entries in a directory */
-static int entry_count(struct inode *inode_ptr){
-  int n = 0;
+/* Ownership and mode from a host stat */
+static void inode_attrs(struct inode * inode_ptr, const struct stat * st){
+  inode_ptr->uid  = st->st_uid;
+  inode_ptr->gid  = st->st_gid;
+  inode_ptr->mode = st->st_mode;
+}
+
+/* Go down a path, creating missing directories. New ones take the
+   attributes of the same host path, or defaults when host is 0. The
+   last entry may be an existing file. Path is cut by strtok */
+static struct entry * entry_create(char * path, int * created, const int host_attrs){
+  struct entry * entry_ptr = (struct entry *) block_ref(inodes[0].dref[0]);
+  char * host = strdup(path);
+  struct stat st;
+
+  if(host == NULL){
+    perror("strdup");
+    return NULL;
+  }
+
+  char * name = strtok(path, "/");
+  while(name){
+    char * next = strtok(NULL, "/");
+
+    /* get/create entry for this subdir */
+    entry_ptr = get_entry(entry_ptr, name);
+    if( (entry_ptr == NULL) ||
+        ((entry_ptr->type == E_FILE) && next)){
+      fprintf(stderr, "Error: Invalid subdir %s\n", name);
+      free(host);
+      return NULL;
+    }
+
+    /* only new entries have no mode yet */
+    struct inode * inode_ptr = &inodes[entry_ptr->inode];
+    *created = (inode_ptr->mode == 0);
+    if(*created){
+      const size_t end = (name - path) + strlen(name);
+      const char saved = host[end];
+      host[end] = '\0';
+      if(!host_attrs || (stat(host, &st) == -1)){
+        st.st_uid  = getuid();
+        st.st_gid  = getgid();
+        st.st_mode = S_IFDIR | 0755;
+      }
+      inode_attrs(inode_ptr, &st);
+      host[end] = saved;
+    }
+    name = next;
+  }
+  free(host);
+  return entry_ptr;
+}
+
+/* Add a file from an open fd, stat gives its attributes. Directories
+   made on the way take the host's when host_attrs is set */
+static int add_fd(char * path, const int fd, const struct stat * st, const int host_attrs){
+  int created;
+
+  if(add_check(path, fd) == -1){
+    return -1;
+  }
+
+  /* go down the path to file */
+  struct entry * entry_ptr = entry_create(path, &created, host_attrs);
+  if((entry_ptr == NULL) || !created){
+    /* stored files are replaced with -u, not added again */
+    if(entry_ptr){
+      fprintf(stderr, "Error: Entry '%.*s' exists\n", NAMESIZE, entry_ptr->name);
+    }
+    return -1;
+  }
+
+  /* write file data to entry, new blocks are taken in order */
+  advise_blocks(meta->sectors[DATA].sector_start, meta->sectors[DATA].sector_size, ADV_SEQUENTIAL);
+  const int stored = write_entry(entry_ptr, fd);
+  advise_blocks(meta->sectors[DATA].sector_start, meta->sectors[DATA].sector_size, ADV_NORMAL);
+  /* set entry to be a file */
+  entry_ptr->type = E_FILE;
+  subtree_add(inodes[entry_ptr->inode].parent, 0, 0, 1, -1);
+
+  /* a partly stored file is not kept */
+  if(stored == -1){
+    fprintf(stderr, "Error: '%.*s' not stored, removed\n", NAMESIZE, entry_ptr->name);
+    entry_remove(entry_ptr);
+    return -1;
+  }
+  inode_attrs(&inodes[entry_ptr->inode], st);
+  return 0;
+}
+
+/* Add a host directory and all below it */
+static void add_tree(const char * path, const struct stat * st){
+  char child[PATH_MAX];
+  struct dirent * dent;
+  int created;
+
+  char * copy = strdup(path);
+  if(copy == NULL){
+    perror("strdup");
+    return;
+  }
+  struct entry * entry_ptr = entry_create(copy, &created, 1);
+  free(copy);
+  if(entry_ptr == NULL){
+    return;
+  }
+  if(entry_ptr->type != E_DIR){
+    fprintf(stderr, "Error: Entry '%.*s' exists and is not a directory\n", NAMESIZE, entry_ptr->name);
+    return;
+  }
+  inode_attrs(&inodes[entry_ptr->inode], st);
+
+  DIR * dir = opendir(path);
+  if(dir == NULL){
+    perror("opendir");
+    return;
+  }
+  while((dent = readdir(dir)) != NULL){
+    struct stat cst;
+
+    if((strcmp(dent->d_name, ".") == 0) || (strcmp(dent->d_name, "..") == 0)){
+      continue;
+    }
+    if(snprintf(child, sizeof(child), "%s/%s", path, dent->d_name) >= sizeof(child)){
+      fprintf(stderr, "Error: Path too long under '%s'\n", path);
+      continue;
+    }
+
+    /* links are not followed, fifos and devices could block on open */
+    if(fstatat(dirfd(dir), dent->d_name, &cst, AT_SYMLINK_NOFOLLOW) == -1){
+      perror("fstatat");
+      continue;
+    }
+    if(S_ISDIR(cst.st_mode)){
+      add_tree(child, &cst);
+    }else if(S_ISREG(cst.st_mode)){
+      const int fd = openat(dirfd(dir), dent->d_name, O_RDONLY | O_NOFOLLOW);
+      if(fd == -1){
+        perror("openat");
+        continue;
+      }
+      add_fd(child, fd, &cst, 1);
+      close(fd);
+    }else{
+      fprintf(stderr, "Error: Skipped '%s', not a file or directory\n", child);
+    }
+  }
+  closedir(dir);
+}
+
+void addfilefs(char* fname){
+  struct stat st;
+
+  /* open input file */
+  const int fd = open(fname, O_RDONLY);
+  if(fd == -1){
+    perror("open");
+    blkdev->release();
+    return;
+  }
+  if(fstat(fd, &st) == -1){
+    perror("fstat");
+    close(fd);
+    blkdev->release();
+    return;
+  }
+
+  /* directories bring their whole tree */
+  if(S_ISDIR(st.st_mode)){
+    close(fd);
+    add_tree(fname, &st);
+  }else{
+    add_fd(fname, fd, &st, 1);
+    close(fd);
+  }
+
+  blkdev->release();
+}
+
+int streamfs(char* path){
+  struct stat st;
+
+  if(fstat(STDIN_FILENO, &st) == -1){
+    perror("fstat");
+    blkdev->release();
+    return -1;
+  }
+
+  /* a bigger pipe lets the producer run ahead of us, a hint only */
+  if(S_ISFIFO(st.st_mode)){
+    fcntl(STDIN_FILENO, F_SETPIPE_SZ, PIPE_BUFFER);
+  }
+
+  /* data made on the fly is ours, as a new file would be */
+  if(!S_ISREG(st.st_mode)){
+    const mode_t mask = umask(0);
+    umask(mask);
+    st.st_uid  = getuid();
+    st.st_gid  = getgid();
+    st.st_mode = S_IFREG | (0666 & ~mask);
+  }
+
+  /* the path names no host directories, new ones get defaults */
+  const int result = add_fd(path, STDIN_FILENO, &st, 0);
+
+  blkdev->release();
+  return result;
+}
+
+void quotafs(char* path, unsigned int bytes, unsigned int count){
+  struct inode * inode_ptr = &inodes[0];
+
+  if(strspn(path, "/") < strlen(path)){
+    struct entry * entry_ptr = entry_lookup(path);
+    if((entry_ptr == NULL) || (entry_ptr->type != E_DIR)){
+      fprintf(stderr, "Error: Directory not found\n");
+      blkdev->release();
+      return;
+    }
+    inode_ptr = &inodes[entry_ptr->inode];
+  }
+
+  inode_ptr->quota.bytes  = bytes;
+  inode_ptr->quota.inodes = count;
+
+  /* usage is already known, tell if it is over */
+  const struct subtree * tree = &inode_ptr->tree;
+  printf("quota: %llu/%u bytes, %u/%u inodes\n", (unsigned long long) tree->blocks * BLKSIZE, bytes,
+         tree->files + tree->dirs, count);
+
+  blkdev->release();
+}
+
+/* Inode of an entry by path, the root for "/". Returns -1 if not found */
+static int path_inode(char * path){
+  if(strspn(path, "/") == strlen(path)){
+    return 0;
+  }
+  struct entry * entry_ptr = entry_lookup(path);
+  if(entry_ptr == NULL){
+    fprintf(stderr, "Error: Entry not found\n");
+    return -1;
+  }
+  return entry_ptr->inode;
+}
+
+void listxattrfs(char* path){
+  const int inode = path_inode(path);
+
+  if(inode >= 0){
+    xattr_print(inodes[inode].xattr, XATTR_INLINE, inode, NULL);
+    if(inodes[inode].xattr_block){
+      xattr_print(block_ref(inodes[inode].xattr_block), BLKSIZE, inode, NULL);
+    }
+  }
+  blkdev->release();
+}
+
+int getxattrfs(char* path, char* name){
+  const int inode = path_inode(path);
+  int found = 0;
+
+  if(inode >= 0){
+    found = xattr_print(inodes[inode].xattr, XATTR_INLINE, inode, name);
+    if(!found && inodes[inode].xattr_block){
+      found = xattr_print(block_ref(inodes[inode].xattr_block), BLKSIZE, inode, name);
+    }
+    if(!found){
+      fprintf(stderr, "Error: No attribute '%s'\n", name);
+    }
+  }
+  blkdev->release();
+  return found ? 0 : -1;
+}
+
+int setxattrfs(char* path, char* name, char* value){
+  const int inode = path_inode(path);
+  int result = -1;
+
+  if(inode >= 0){
+    result = xattr_set(inode, name, value);
+  }
+  blkdev->release();
+  return result;
+}
+
+/* Set ownership and mode of a host file from an inode, as far as we may */
+static void host_attrs(const int fd, const struct inode * inode_ptr){
+  if(inode_ptr->mode == 0){
+    return;
+  }
+  /* chown clears set-id bits, so it goes first */
+  if((fchown(fd, inode_ptr->uid, inode_ptr->gid) == -1) && (errno != EPERM)){
+    perror("fchown");
+  }
+  if(fchmod(fd, inode_ptr->mode & 07777) == -1){
+    perror("fchmod");
+  }
+}
+
+/* Write an entry to a host directory, with everything below it.
+   Attributes are set as each one is written, directories last */
+static int entry_extract(const int dirfd, struct entry * entry_ptr){
+  char name[NAMESIZE + 1];
+  int fd, errors = 0;
+
+  /* names come from the image, none may lead out of the target directory */
+  memcpy(name, entry_ptr->name, NAMESIZE);
+  name[NAMESIZE] = '\0';
+  if((name[0] == '\0') || strchr(name, '/') || (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0) ||
+     (entry_ptr->inode >= TOTAL_INODES)){
+    fprintf(stderr, "Error: Invalid entry '%s'\n", name);
+    return 1;
+  }
+  struct inode * inode_ptr = &inodes[entry_ptr->inode];
+
+  if(entry_ptr->type == E_DIR){
+    if(!inode_walkable(inode_ptr)){
+      fprintf(stderr, "Error: Directory '%s' is damaged\n", name);
+      return 1;
+    }
+    if((mkdirat(dirfd, name, 0700) == -1) && (errno != EEXIST)){
+      perror("mkdirat");
+      return 1;
+    }
+    if((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1){
+      perror("openat");
+      return 1;
+    }
+    FOREACH_ENTRY(inode_ptr){
+        if(entry_ptr->inode != 0){
+          errors += entry_extract(fd, entry_ptr);
+        }
+      }
+    }
+    host_attrs(fd, inode_ptr);
+    close(fd);
+    return errors;
+  }
+
+  if((fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600)) == -1){
+    perror("openat");
+    return 1;
+  }
+  FILE * out = fdopen(fd, "w");
+  if(out == NULL){
+    perror("fdopen");
+    close(fd);
+    return 1;
+  }
+  advise_inode(inode_ptr, ADV_SEQUENTIAL);
+  errors += (entry_read(entry_ptr, out) == -1);
+  advise_inode(inode_ptr, ADV_NORMAL);
+  if(fflush(out) == EOF){
+    perror("fflush");
+    errors++;
+  }
+  host_attrs(fd, inode_ptr);
+  fclose(out);
+  return errors;
+}
+
+int extracttreefs(char* path, char* dest){
+  int errors = 0;
+
+  if((mkdir(dest, 0755) == -1) && (errno != EEXIST)){
+    perror("mkdir");
+    blkdev->release();
+    return -1;
+  }
+  const int dirfd = open(dest, O_RDONLY | O_DIRECTORY);
+  if(dirfd == -1){
+    perror("open");
+    blkdev->release();
+    return -1;
+  }
+
+  /* the root has its contents written, anything else itself */
+  if(strspn(path, "/") == strlen(path)){
+    struct inode * inode_ptr = &inodes[0];
+    FOREACH_ENTRY(inode_ptr){
+        if(entry_ptr->inode != 0){
+          errors += entry_extract(dirfd, entry_ptr);
+        }
+      }
+    }
+  }else{
+    struct entry * entry_ptr = entry_lookup(path);
+    if(entry_ptr == NULL){
+      fprintf(stderr, "Error: Not found\n");
+      errors++;
+    }else{
+      errors += entry_extract(dirfd, entry_ptr);
+    }
+  }
+  close(dirfd);
+
+  blkdev->release();
+  return errors ? -1 : 0;
+}
+
+void removefilefs(char* fname){
+  entry_remove_path(&inodes[0], fname);
+
+  blkdev->release();
+}
+
+int updatefilefs(char* fname){
+  int status = -1;
+
+  /* open input file */
+  const int fd = open(fname, O_RDONLY);
+  if(fd == -1){
+    perror("open");
+    blkdev->release();
+    return -1;
+  }
+
+  /* keep path for addfilefs, strtok will cut it */
+  char * path = strdup(fname);
+  struct entry * entry_ptr = entry_lookup(fname);
+
+  if(entry_ptr == NULL){
+    /* nothing stored yet, do a normal add */
+    close(fd);
+    addfilefs(path);
+    status = 0;
+  }else if(entry_ptr->type != E_FILE){
+    fprintf(stderr, "Error: Not a file\n");
+    close(fd);
+  }else{
+    /* all stored blocks are compared */
+    struct inode * inode_ptr = &inodes[entry_ptr->inode];
+    struct stat st;
+    const int have_stat = (fstat(fd, &st) == 0);
+
+    /* growth is checked against quotas up front */
+    if(have_stat && S_ISREG(st.st_mode) && (file_blocks(st.st_size) > inode_blocks(inode_ptr)) &&
+       (quota_check(inode_ptr->parent, file_blocks(st.st_size) - inode_blocks(inode_ptr), 0) == -1)){
+      close(fd);
+      free(path);
+      blkdev->release();
+      return -1;
+    }
+    advise_inode(inode_ptr, ADV_SEQUENTIAL);
+    advise_inode(inode_ptr, ADV_WILLNEED);
+    /* attributes only go with contents stored whole */
+    if(update_entry(entry_ptr, fd) != -1){
+      status = 0;
+      if(have_stat){
+        inode_attrs(inode_ptr, &st);
+      }
+    }else{
+      fprintf(stderr, "Error: '%.*s' not updated whole\n", NAMESIZE, entry_ptr->name);
+    }
+    advise_inode(inode_ptr, ADV_NORMAL);
+    close(fd);
+  }
+  free(path);
+
+  blkdev->release();
+  return status;
+}
+
+void extractfilefs(char* fname){
+
+  struct entry * entry_ptr = entry_lookup(fname);
+  if(entry_ptr == NULL){
+    fprintf(stderr, "Error: Not found\n");
+    blkdev->release();
+    return;
+  }
+  /* only file blocks carry checksums */
+  if(entry_ptr->type != E_FILE){
+    fprintf(stderr, "Error: Not a file\n");
+    blkdev->release();
+    return;
+  }
+
+  /* output to stdout */
+  struct inode * inode_ptr = &inodes[entry_ptr->inode];
+  advise_inode(inode_ptr, ADV_SEQUENTIAL);
+  entry_read(entry_ptr, stdout);
+  advise_inode(inode_ptr, ADV_NORMAL);
+
+  blkdev->release();
+}
+
+static void entry_debug(struct inode * inode_ptr, int indent, char * name){
+
+  if(name == NULL){
+    return;
+  }
+
+  //First list all of the entries
   FOREACH_ENTRY(inode_ptr){
-      if(entry_ptr->inode != 0){
-        ++n;
+      if(entry_ptr->inode == 0){
+        continue;
+      }
+
+      struct inode * einode_ptr = &inodes[entry_ptr->inode];
+
+      print_indent(indent + 1);
+      switch(entry_ptr->type){
+        case E_FILE:
+          if(strcmp(entry_ptr->name, name) == 0){
+            printf("'%s' %d inode=%d\n", entry_ptr->name, entry_ptr->size, entry_ptr->inode);
+            return;
+          }
+          break;
+        case E_DIR:
+          printf("directory '%s' inode=%d:\n", entry_ptr->name, entry_ptr->inode);
+          if(strcmp(entry_ptr->name, name) == 0){
+            name = strtok(NULL, "/");
+            entry_debug(einode_ptr, indent + 1, name);
+            return;
+          }
+          break;
+        default:
+          break;
       }
     }
   }
-  return n;
+
+}
+
+void debugfs(char * fname){
+  struct inode * inode_ptr = &inodes[0];
+  struct entry * entry_ptr = (struct entry *) block_ref(inode_ptr->dref[0]);
+
+  char * name = strtok(fname, "/");
+
+  entry_debug(&inodes[entry_ptr->inode], 0, name);
+
+  blkdev->release();
 }
 
-/* Remove entry by following a path */
-static void entry_remove_path(struct inode * inode_ptr, char * path){
+/* Block owners, as found by walking the directory tree */
+enum block_owners {O_FREE = 0, O_SYSTEM, O_DIR, O_INDIRECT, O_FILE, O_XATTR, O_TAIL};
 
-  /* On first call, it will load path to strtok, on next it will give subdirs */
-  const char * name = strtok(path, "/");
-  if(name == NULL){
-    return;
+/* Claim a block for an owner, returns number of errors found */
+static int claim_block(unsigned char * owner, const unsigned int block, const unsigned char type, const unsigned int inode){
+  if((block < meta->sectors[DATA].sector_start) || (block >= meta->total_blocks)){
+    fprintf(stderr, "Error: Inode %u references block %u outside data\n", inode, block);
+    return 1;
+  }
+  if(bitlist_status(block) == 0){
+    fprintf(stderr, "Error: Inode %u references free block %u\n", inode, block);
+    return 1;
+  }
+  if(owner[block] != O_FREE){
+    fprintf(stderr, "Error: Inode %u references block %u already in use\n", inode, block);
+    return 1;
   }
+  owner[block] = type;
+  return 0;
+}
 
-  struct entry * entry_ptr = search_entry(inode_ptr, name);
-  if(entry_ptr == NULL){
-    fprintf(stderr, "Error: Entry '%s' not found\n", name);
-    return;
+/* Claim all blocks referenced by an inode */
+static int claim_inode(unsigned char * owner, const unsigned int inode, const unsigned char type){
+  struct inode * inode_ptr = &inodes[inode];
+  int errors = 0;
+
+  if(inode_ptr->total_ref > MAX_REFS){
+    fprintf(stderr, "Error: Inode %u has %u references\n", inode, inode_ptr->total_ref);
+    return 1;
   }
 
-  if(entry_ptr->type == E_DIR){ /* if its a subdir */
-    struct inode * einode_ptr = &inodes[entry_ptr->inode];
-    /* recurse into the directory */
-    entry_remove_path(einode_ptr, NULL);
+  if(inode_ptr->iref > 0){
+    errors += claim_block(owner, inode_ptr->iref, O_INDIRECT, inode);
+  }
 
-    if(entry_count(einode_ptr) == 0){ /* if dir is empry after file deleted */
-      entry_remove(entry_ptr);    /* remove it */
-    }
+  /* attribute and tail blocks are shared */
+  if((inode_ptr->xattr_block > 0) && (owner[inode_ptr->xattr_block] != O_XATTR)){
+    errors += claim_block(owner, inode_ptr->xattr_block, O_XATTR, inode);
+  }
+  if((inode_ptr->tail_len > 0) && (owner[inode_ptr->tail_block] != O_TAIL)){
+    errors += claim_block(owner, inode_ptr->tail_block, O_TAIL, inode);
+  }
 
-  }else if(entry_ptr->type == E_FILE){
-    entry_remove(entry_ptr);
+  FOREACH_BLOCK(inode_ptr)
+    errors += claim_block(owner, block, type, inode);
   }
+  return errors;
 }
 
-/* List entries in a directory */
-static void entry_list(struct inode * inode_ptr, const int level){
+/* Walk directory tree, marking the owner of each block */
+static int walk_owners(struct inode * inode_ptr, unsigned char * owner, unsigned char * seen){
+  int errors = 0;
 
   FOREACH_ENTRY(inode_ptr){
       if(entry_ptr->inode == 0){
         continue;
       }
 
-      print_indent(level);
-
-      switch(entry_ptr->type){
-        case E_FILE:
-          printf("'%s' %d\n", entry_ptr->name, entry_ptr->size);
-          break;
-        case E_DIR:
-          printf("directory '%s':\n", entry_ptr->name);
-          entry_list(&inodes[entry_ptr->inode], level+1);
-          break;
-        default:
-          break;
+      const unsigned int inode = entry_ptr->inode;
+      if(inode >= TOTAL_INODES){
+        fprintf(stderr, "Error: Entry '%s' has invalid inode %u\n", entry_ptr->name, inode);
+        errors++;
+        continue;
+      }
+      if(seen[inode]){
+        fprintf(stderr, "Error: Inode %u is linked twice\n", inode);
+        errors++;
+        continue;
+      }
+      seen[inode] = 1;
+
+      if(entry_ptr->type == E_DIR){
+        const int found = claim_inode(owner, inode, O_DIR);
+        /* do not follow a broken directory */
+        errors += found ? found : walk_owners(&inodes[inode], owner, seen);
+      }else{
+        errors += claim_inode(owner, inode, O_FILE);
       }
     }
   }
+  return errors;
 }
 
-void mapfs(int fd){
-  if ((fs = mmap(NULL, FSSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == NULL){
-      perror("mmap failed");
-      exit(EXIT_FAILURE);
+/* Work given to each scrub thread */
+struct scrub_job {
+  const unsigned char * owner;
+  unsigned int  first;      //first block in range
+  unsigned int  last;       //block after range
+  unsigned int  verified;   //file blocks verified
+  unsigned int  errors;     //checksum errors
+  unsigned int *progress;   //blocks scanned, shared by all jobs
+};
+
+#define SCRUB_STEP 1024
+
+/* Verify the checksums of file blocks in a range */
+static void * scrub_range(void * arg){
+  struct scrub_job * job = arg;
+  unsigned int n, scanned = 0;
+  unsigned char * buf = blkdev_alloc(1);
+
+  if(buf == NULL){
+    perror("blkdev_alloc");
+    job->errors++;
+    __atomic_add_fetch(job->progress, job->last - job->first, __ATOMIC_RELAXED);
+    return NULL;
   }
-}
 
+  for(n = job->first; n < job->last; n++){
+    if((job->owner[n] == O_FILE) || (job->owner[n] == O_TAIL)){
+      const void * data = block_read(n, buf);
+      if((data == NULL) || !csum_verify(n, data)){
+        fprintf(stderr, "Error: Checksum mismatch in block %u\n", n);
+        job->errors++;
+      }
+      job->verified++;
+    }
 
-void unmapfs(){
-  munmap(fs, FSSIZE);
+    if(++scanned == SCRUB_STEP){
+      __atomic_add_fetch(job->progress, scanned, __ATOMIC_RELAXED);
+      scanned = 0;
+    }
+  }
+  __atomic_add_fetch(job->progress, scanned, __ATOMIC_RELAXED);
+  free(buf);
+  return NULL;
+}
+
+static double elapsed(const struct timespec * start){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
-void setup_sectors(){
-  meta->total_blocks = TOTAL_BLOCKS;
-  meta->total_blocks = TOTAL_INODES;
-  meta->block_bytes  = BLKSIZE;
+int scrubfs(int threads){
+  int t;
+  unsigned int n, verified = 0, errors = 0, progress = 0;
+  struct timespec start;
+  const unsigned int first = meta->sectors[DATA].sector_start;
+  const unsigned int total = meta->total_blocks - first;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  unsigned char * owner = calloc(meta->total_blocks, 1);
+  unsigned char * seen  = calloc(TOTAL_INODES, 1);
+  if((owner == NULL) || (seen == NULL)){
+    perror("calloc");
+    free(owner);
+    free(seen);
+    blkdev->release();
+    return -1;
+  }
 
-  // superblock takes 1 block
-  meta->sectors[SUPER].sector_start = 0;
-  meta->sectors[SUPER].sector_size = 1;
+  /* metadata first, it tells us which blocks hold file data */
+  for(n=0; n < first; n++){
+    owner[n] = O_SYSTEM;
+  }
+  seen[0] = 1;
+  errors += claim_inode(owner, 0, O_DIR);
+  errors += walk_owners(&inodes[0], owner, seen);
 
-  // bitmap takes 1 bit for each block
-  meta->sectors[FREELIST].sector_start = meta->sectors[SUPER].sector_size;
-  meta->sectors[FREELIST].sector_size = (TOTAL_BLOCKS / 8) / BLKSIZE;
+  /* then data, each thread takes a disjoint range */
+  if(threads < 1){
+    threads = 1;
+  }
+  if(threads > total / SCRUB_STEP + 1){
+    threads = total / SCRUB_STEP + 1;
+  }
 
-  //inodes are 100
-  meta->sectors[INODES].sector_start = meta->sectors[FREELIST].sector_start + meta->sectors[FREELIST].sector_size;
-  meta->sectors[INODES].sector_size  = TOTAL_INODES / (BLKSIZE / sizeof(struct inode));
+  pthread_t tids[threads];
+  int started[threads];
+  struct scrub_job jobs[threads];
+
+  for(t=0; t < threads; t++){
+    jobs[t].owner    = owner;
+    jobs[t].first    = first + (unsigned long long) total * t / threads;
+    jobs[t].last     = first + (unsigned long long) total * (t + 1) / threads;
+    jobs[t].verified = 0;
+    jobs[t].errors   = 0;
+    jobs[t].progress = &progress;
+    /* without a thread, the range is scrubbed here */
+    started[t] = (pthread_create(&tids[t], NULL, scrub_range, &jobs[t]) == 0);
+    if(!started[t]){
+      scrub_range(&jobs[t]);
+    }
+  }
 
-  //data is at end
-  meta->sectors[DATA].sector_start = meta->sectors[INODES].sector_start + meta->sectors[INODES].sector_size;
-  meta->sectors[DATA].sector_size  = meta->total_blocks - (meta->sectors[FREELIST].sector_size + meta->sectors[INODES].sector_size);
-}
+  /* report progress, while threads work */
+  if(isatty(STDERR_FILENO)){
+    const struct timespec tick = {0, 100000000};
+    while(__atomic_load_n(&progress, __ATOMIC_RELAXED) < total){
+      fprintf(stderr, "\rscrub: %3u%%", (unsigned int) ((unsigned long long) progress * 100 / total));
+      nanosleep(&tick, NULL);
+    }
+    fprintf(stderr, "\r");
+  }
 
-static void create_root(){
-  struct inode * inode_ptr = &inodes[0];
-  const int block = expand(inode_ptr);
-  struct entry * entry_ptr = (struct entry *)block_ref(block);
+  for(t=0; t < threads; t++){
+    if(started[t]){
+      pthread_join(tids[t], NULL);
+    }
+    verified += jobs[t].verified;
+    errors   += jobs[t].errors;
+  }
 
-  entry_ptr->name[0] = '/';
-  entry_ptr->type   = E_DIR;
-  entry_ptr->inode  = 0;
-  entry_ptr->size   = 0;
+  const double secs = elapsed(&start);
+  printf("scrub: %u blocks verified, %u errors, %.3fs, %.1f MB/s\n", verified, errors, secs,
+         (secs > 0) ? (verified * (double) BLKSIZE) / secs / 1e6 : 0.0);
+
+  free(owner);
+  free(seen);
+  blkdev->release();
+  return errors ? -1 : 0;
 }
 
-void formatfs(){
-  int i;
+/* Walk directory tree, marking reachable inodes and dropping dangling entries */
+static int fsck_walk(struct inode * inode_ptr, unsigned char * seen, int * repaired){
+  const unsigned int dir = inode_ptr - inodes;
+  int errors = 0;
 
-  bzero(fs, FSSIZE);
+  FOREACH_ENTRY(inode_ptr){
+      if(entry_ptr->inode == 0){
+        continue;
+      }
 
-  /* save metadata info*/
-  meta = (struct metadata*) fs;
+      /* lookups go by the hash and length kept with the name */
+      const size_t len = strnlen(entry_ptr->name, NAMESIZE);
+      if((entry_ptr->name_len != len) || (entry_ptr->hash != name_hash(entry_ptr->name, len))){
+        fprintf(stderr, "Error: Entry '%.*s' has a stale name hash\n", (int) len, entry_ptr->name);
+        entry_ptr->name_len = len;
+        entry_ptr->hash     = name_hash(entry_ptr->name, len);
+        (*repaired)++;
+        errors++;
+      }
 
-  setup_sectors();
-  loadfs();
+      const unsigned int inode = entry_ptr->inode;
+      if((inode >= TOTAL_INODES) || !inode_used(&inodes[inode])){
+        fprintf(stderr, "Error: Entry '%s' points to free inode %u\n", entry_ptr->name, inode);
+      }else if(seen[inode]){
+        fprintf(stderr, "Error: Entry '%s' links inode %u twice\n", entry_ptr->name, inode);
+      }else{
+        seen[inode] = 1;
+        if(inodes[inode].parent != dir){
+          fprintf(stderr, "Error: Inode %u has parent %u, not %u\n", inode, inodes[inode].parent, dir);
+          inodes[inode].parent = dir;
+          (*repaired)++;
+          errors++;
+        }
+        if((entry_ptr->type == E_DIR) && inode_walkable(&inodes[inode])){
+          errors += fsck_walk(&inodes[inode], seen, repaired);
+        }
+        continue;
+      }
 
-  /* setup system blocks as used in bit list*/
-  bitlist_up(0);
-  for(i=0; i < meta->sectors[FREELIST].sector_size; i++){
-    bitlist_up(meta->sectors[FREELIST].sector_start + i);
+      /* dangling entry, drop it */
+      bzero(entry_ptr, sizeof(struct entry));
+      (*repaired)++;
+      errors++;
+    }
   }
 
-  for(i=0; i < meta->sectors[INODES].sector_size; i++){
-    bitlist_up(meta->sectors[INODES].sector_start + i);
+  /* dropped entries leave gaps in sorted directories */
+  if(dirs_sorted() && (entry_sort(inode_ptr) > 0)){
+    fprintf(stderr, "Error: Directory inode %u is out of order\n", dir);
+    (*repaired)++;
+    errors++;
   }
-
-  /* create the / directory */
-  create_root();
+  return errors;
 }
 
+/* Add the names below a directory to an index table. Inodes in left
+   are cleared as they are added, so each is added and walked once */
+static void index_walk(struct name_slot * table, const unsigned int dir, unsigned char * left){
+  struct inode * inode_ptr = &inodes[dir];
 
-void loadfs(){
-  meta    = (struct metadata*) fs;
-  bitlist = (unsigned char*) block_ref(meta->sectors[FREELIST].sector_start);
-  inodes  = (struct inode*)  block_ref(meta->sectors[INODES].sector_start);
+  FOREACH_ENTRY(inode_ptr){
+      const unsigned int inode = entry_ptr->inode;
+      if((inode == 0) || (inode >= TOTAL_INODES) || !left[inode]){
+        continue;
+      }
+      left[inode] = 0;
+      index_add(table, entry_ptr->name, inode, dir);
+      if((entry_ptr->type == E_DIR) && inode_walkable(&inodes[inode])){
+        index_walk(table, inode, left);
+      }
+    }
+  }
 }
 
-void lsfs(){
-  struct inode * inode_ptr = &inodes[0];
-  entry_list(inode_ptr, 0);
+/* Index holds the same records as a rebuilt one, in any slot */
+static int index_same(const struct name_slot * built){
+  unsigned int i, j, stored = 0, wanted = 0, found = 0;
+
+  for(i=0; i < INDEX_SLOTS; i++){
+    stored += (index_slot(NULL, i)->inode != 0);
+    if(built[i].inode == 0){
+      continue;
+    }
+    wanted++;
+    for(j = built[i].hash & (INDEX_SLOTS - 1); index_slot(NULL, j)->inode != 0; j = (j + 1) & (INDEX_SLOTS - 1)){
+      const struct name_slot * slot = index_slot(NULL, j);
+      if((slot->hash == built[i].hash) && (slot->inode == built[i].inode) &&
+         (slot->parent == built[i].parent) && (strncmp(slot->head, built[i].head, INDEX_HEAD) == 0)){
+        found++;
+        break;
+      }
+    }
+  }
+  return (found == wanted) && (stored == wanted);
 }
 
+/* Work given to each fsck thread */
+struct fsck_job {
+  const unsigned char * seen;
+  unsigned char       * expected;  //bit list rebuilt from block maps
+  unsigned short      * bad;       //bad references, per inode
+  unsigned int          first;     //first inode in range
+  unsigned int          last;      //inode after range
+};
 
-void addfilefs(char* fname){
+/* Mark a block in the rebuilt bit list, returns 1 if it is bad */
+static int fsck_mark(unsigned char * expected, const unsigned int block){
+  if(!in_data(block)){
+    return 1;
+  }
+  const unsigned char bit = 1 << (block % 8);
+  return (__atomic_fetch_or(&expected[block / 8], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
 
-  struct inode * inode_ptr = &inodes[0];
-  struct entry * entry_ptr = (struct entry *) block_ref(inode_ptr->dref[0]);
+/* Rebuild the bit list from the block maps of an inode range */
+static void * fsck_range(void * arg){
+  struct fsck_job * job = arg;
+  unsigned int inode;
 
-  /* open input file */
-  const int fd = open(fname, O_RDONLY);
-  if(fd == -1){
-    perror("open");
-    return;
-  }
+  for(inode = job->first; inode < job->last; inode++){
+    struct inode * inode_ptr = &inodes[inode];
 
-  /* go down the path to file */
-  char * name = strtok(fname, "/");
-  while(name){
-    /* get/create entry for this subdir */
-    entry_ptr = get_entry(entry_ptr, name);
-    if( (entry_ptr == NULL) ||
-        (entry_ptr->type == E_FILE)){
-      fprintf(stderr, "Error: Invalid subdir %s\n", name);
-      return;
+    /* free and orphan inodes hold nothing */
+    if(!inode_used(inode_ptr) || !job->seen[inode]){
+      continue;
     }
-    name = strtok(NULL, "/");
-  }
 
-  /* write file data to entry */
-  write_entry(entry_ptr, fd);
-  /* set entry to be a file */
-  entry_ptr->type = E_FILE;
+    /* every valid reference is marked, so a damaged inode keeps its blocks */
+    const unsigned int refs = (inode_ptr->total_ref < MAX_REFS) ? inode_ptr->total_ref : MAX_REFS;
+    unsigned int i;
 
-  close(fd);
-}
+    job->bad[inode] += inode_ptr->total_ref - refs;
+    for(i=0; (i < refs) && (i < DREFSIZE); i++){
+      job->bad[inode] += fsck_mark(job->expected, inode_ptr->dref[i]);
+    }
+    if(inode_ptr->iref > 0){
+      job->bad[inode] += fsck_mark(job->expected, inode_ptr->iref);
+    }
+    if(refs > DREFSIZE){
+      if(in_data(inode_ptr->iref)){
+        const unsigned short * indirect = (unsigned short *) block_ref(inode_ptr->iref);
+        for(i = DREFSIZE; i < refs; i++){
+          job->bad[inode] += fsck_mark(job->expected, indirect[i - DREFSIZE]);
+        }
+      }else{
+        job->bad[inode] += refs - DREFSIZE;
+      }
+    }
 
-void removefilefs(char* fname){
-  entry_remove_path(&inodes[0], fname);
+    /* attribute and tail blocks are shared, marking one twice is fine */
+    if(inode_ptr->xattr_block > 0){
+      if(in_data(inode_ptr->xattr_block)){
+        fsck_mark(job->expected, inode_ptr->xattr_block);
+      }else{
+        job->bad[inode]++;
+      }
+    }
+    if(inode_ptr->tail_len > 0){
+      if(in_data(inode_ptr->tail_block) && (inode_ptr->tail_off + inode_ptr->tail_len <= BLKSIZE)){
+        fsck_mark(job->expected, inode_ptr->tail_block);
+      }else{
+        job->bad[inode]++;
+      }
+    }
+  }
+  return NULL;
 }
 
-void extractfilefs(char* fname){
-  //start from root directory
-  struct inode * inode_ptr = &inodes[0];
-  struct entry * entry_ptr = NULL;
-
-  /* go down the path to file */
-  char * name = strtok(fname, "/");
-  while(name){
+/* Rebuild what is kept up to date from the tree: subtree totals, tail
+   references, the name index and the free block summary. Returns errors,
+   counting each structure found out of date as repaired too. */
+static int derived_rebuild(const unsigned char * seen, const int threads, const int report, int * repaired){
+  unsigned int n;
+  int errors = 0;
+
+  /* subtree totals, against the ones found by walking */
+  struct walker * walk = walk_tree(0, "", -1, NULL, threads);
+  if(walk == NULL){
+    errors++;
+  }else{
+    for(n=0; n < TOTAL_INODES; n++){
+      if(walk->dirs[n].path == NULL){
+        continue;
+      }
+      struct subtree found = {walk->dirs[n].bytes, walk->dirs[n].blocks - inode_blocks(&inodes[n]),
+                              walk->dirs[n].files, walk->dirs[n].dirs};
+      if(memcmp(&inodes[n].tree, &found, sizeof(found)) != 0){
+        if(report){
+          fprintf(stderr, "Error: Directory inode %u has wrong subtree totals\n", n);
+        }
+        inodes[n].tree = found;
+        errors++;
+        (*repaired)++;
+      }
+    }
+    walk_free(walk);
+  }
 
-    /* search for the name in this directory */
-    entry_ptr = search_entry(inode_ptr, name);
-    if(entry_ptr == NULL){
-      fprintf(stderr, "Error: Not found\n");
-      return;
+  /* tail block references, against the tails found */
+  unsigned short * tails = calloc(meta->total_blocks, sizeof(unsigned short));
+  if(tails == NULL){
+    perror("calloc");
+    errors++;
+  }else{
+    for(n=0; n < TOTAL_INODES; n++){
+      if(seen[n] && (inodes[n].tail_len > 0) && in_data(inodes[n].tail_block)){
+        tails[inodes[n].tail_block]++;
+      }
+    }
+    for(n=0; n < meta->total_blocks; n++){
+      struct tail_head * head = tails[n] ? block_ref(n) : NULL;
+      if(head && (head->refs != tails[n])){
+        if(report){
+          fprintf(stderr, "Error: Tail block %u has %u references, not %u\n", n, head->refs, tails[n]);
+        }
+        head->refs = tails[n];
+        csum_update(n, head);
+        errors++;
+        (*repaired)++;
+      }
     }
+    free(tails);
+  }
 
-    if(entry_ptr->type == E_DIR){
-      /* go to next directory */
-      inode_ptr = &inodes[entry_ptr->inode];
+  /* name index, against one built from the tree */
+  if(index_enabled()){
+    struct name_slot * built = calloc(INDEX_SLOTS, sizeof(struct name_slot));
+    if(built == NULL){
+      perror("calloc");
+      errors++;
     }else{
-      break;
+      unsigned char left[TOTAL_INODES];
+      memcpy(left, seen, sizeof(left));
+      index_walk(built, 0, left);
+      if(!index_same(built)){
+        if(report){
+          fprintf(stderr, "Error: Name index is out of date\n");
+        }
+        for(n=0; n < INDEX_SLOTS; n++){
+          *index_slot(NULL, n) = built[n];
+        }
+        errors++;
+        (*repaired)++;
+      }
+      free(built);
     }
-    name = strtok(NULL, "/");
   }
 
-  /* output to stdout */
-  entry_read(entry_ptr, stdout);
+  /* summary, against the bit list as it is */
+  if(summary_build() > 0){
+    if(report){
+      fprintf(stderr, "Error: Free block summary is out of date\n");
+    }
+    errors++;
+    (*repaired)++;
+  }
+  return errors;
 }
 
-static void entry_debug(struct inode * inode_ptr, int indent, char * name){
+/* Mark the inodes reachable below a directory, each once */
+static void reach_walk(struct inode * inode_ptr, unsigned char * seen){
+  FOREACH_ENTRY(inode_ptr){
+      const unsigned int inode = entry_ptr->inode;
+      if((inode == 0) || (inode >= TOTAL_INODES) || seen[inode] || !inode_used(&inodes[inode])){
+        continue;
+      }
+      seen[inode] = 1;
+      if((entry_ptr->type == E_DIR) && inode_walkable(&inodes[inode])){
+        reach_walk(&inodes[inode], seen);
+      }
+    }
+  }
+}
 
-  if(name == NULL){
+/* Open after an unclean shutdown, rebuild the structures derived from the tree */
+static void recover(){
+  unsigned char seen[TOTAL_INODES];
+  int repaired = 0;
+
+  /* a damaged root is left to fsck */
+  if((inodes[0].total_ref == 0) || !inode_walkable(&inodes[0])){
     return;
   }
+  /* only what the tree reaches, orphans are left to fsck */
+  bzero(seen, sizeof(seen));
+  seen[0] = 1;
+  reach_walk(&inodes[0], seen);
+  derived_rebuild(seen, 1, 0, &repaired);
+  if(meta->xattr_block && !bitlist_status(meta->xattr_block)){
+    meta->xattr_block = 0;
+  }
+  if(meta->tail_block && !bitlist_status(meta->tail_block)){
+    meta->tail_block = 0;
+  }
+  blkdev->release();
+}
 
-  //First list all of the entries
-  FOREACH_ENTRY(inode_ptr){
-      if(entry_ptr->inode == 0){
-        continue;
-      }
+int fsckfs(int threads){
+  int t;
+  unsigned int n, leaked = 0, lost = 0;
+  int errors = 0, repaired = 0;
+  struct metadata layout;
+  struct timespec start;
 
-      struct inode * einode_ptr = &inodes[entry_ptr->inode];
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-      print_indent(indent + 1);
-      switch(entry_ptr->type){
-        case E_FILE:
-          if(strcmp(entry_ptr->name, name) == 0){
-            printf("'%s' %d inode=%d\n", entry_ptr->name, entry_ptr->size, entry_ptr->inode);
-            return;
-          }
-          break;
-        case E_DIR:
-          printf("directory '%s' inode=%d:\n", entry_ptr->name, entry_ptr->inode);
-          if(strcmp(entry_ptr->name, name) == 0){
-            name = strtok(NULL, "/");
-            entry_debug(einode_ptr, indent + 1, name);
-            return;
-          }
-          break;
-        default:
-          break;
+  /* superblock */
+  setup_sectors(&layout);
+  if(memcmp(meta->sectors, layout.sectors, sizeof(layout.sectors)) != 0){
+    fprintf(stderr, "Error: Sector layout is damaged, can't check\n");
+    blkdev->release();
+    return -1;
+  }
+  if((meta->total_blocks != layout.total_blocks) || (meta->total_inodes != layout.total_inodes)){
+    fprintf(stderr, "Error: Superblock counts are wrong (%u blocks, %u inodes)\n", meta->total_blocks, meta->total_inodes);
+    meta->total_blocks = layout.total_blocks;
+    meta->total_inodes = layout.total_inodes;
+    errors++;
+    repaired++;
+  }
+
+  if((inodes[0].total_ref == 0) || !inode_walkable(&inodes[0])){
+    fprintf(stderr, "Error: Root directory is damaged, can't check\n");
+    blkdev->release();
+    return -1;
+  }
+
+  const unsigned int bytes = words_for(meta->total_blocks) * sizeof(unsigned long long);
+  unsigned char  * seen     = calloc(TOTAL_INODES, 1);
+  unsigned short * bad      = calloc(TOTAL_INODES, sizeof(unsigned short));
+  unsigned char  * expected = calloc(bytes, 1);
+  if((seen == NULL) || (bad == NULL) || (expected == NULL)){
+    perror("calloc");
+    free(seen);
+    free(bad);
+    free(expected);
+    blkdev->release();
+    return -1;
+  }
+
+  /* directory tree, to find reachable inodes */
+  seen[0] = 1;
+  errors += fsck_walk(&inodes[0], seen, &repaired);
+
+  /* block maps, each thread takes an inode range */
+  bits_fill(expected, 0, meta->sectors[DATA].sector_start, 1);
+  bits_fill(expected, meta->total_blocks, bytes * 8 - meta->total_blocks, 1);
+
+  if(threads < 1){
+    threads = 1;
+  }
+  if(threads > TOTAL_INODES){
+    threads = TOTAL_INODES;
+  }
+
+  pthread_t tids[threads];
+  int started[threads];
+  struct fsck_job jobs[threads];
+
+  for(t=0; t < threads; t++){
+    jobs[t].seen     = seen;
+    jobs[t].expected = expected;
+    jobs[t].bad      = bad;
+    jobs[t].first    = TOTAL_INODES * t / threads;
+    jobs[t].last     = TOTAL_INODES * (t + 1) / threads;
+    /* without a thread, the range is checked here */
+    started[t] = (pthread_create(&tids[t], NULL, fsck_range, &jobs[t]) == 0);
+    if(!started[t]){
+      fsck_range(&jobs[t]);
+    }
+  }
+  for(t=0; t < threads; t++){
+    if(started[t]){
+      pthread_join(tids[t], NULL);
+    }
+  }
+
+  /* inodes */
+  for(n=0; n < TOTAL_INODES; n++){
+    if(bad[n] > 0){
+      fprintf(stderr, "Error: Inode %u has %u bad block references (not repaired)\n", n, bad[n]);
+      errors++;
+    }
+    if(inode_used(&inodes[n]) && !seen[n]){
+      fprintf(stderr, "Error: Inode %u is orphan\n", n);
+      if(in_data(inodes[n].xattr_block)){
+        xattr_unshare(n);
       }
+      bzero(&inodes[n], sizeof(struct inode));
+      errors++;
+      repaired++;
     }
   }
 
-}
+  /* structures kept up to date from the tree */
+  errors += derived_rebuild(seen, threads, 1, &repaired);
 
-void debugfs(char * fname){
-  struct inode * inode_ptr = &inodes[0];
-  struct entry * entry_ptr = (struct entry *) block_ref(inode_ptr->dref[0]);
+  /* bit list, against the one rebuilt */
+  for(n=0; n < bytes; n += sizeof(unsigned long long)){
+    unsigned long long have = 0, want = 0;
+    const size_t len = (bytes - n < sizeof(have)) ? bytes - n : sizeof(have);
 
-  char * name = strtok(fname, "/");
+    memcpy(&have, &bitlist[n], len);
+    memcpy(&want, &expected[n], len);
+    if(have != want){
+      leaked += __builtin_popcountll(have & ~want);
+      lost   += __builtin_popcountll(want & ~have);
+      memcpy(&bitlist[n], &expected[n], len);
+    }
+  }
+  if(leaked + lost > 0){
+    summary_build();
+  }
+  if(meta->xattr_block && !bitlist_status(meta->xattr_block)){
+    meta->xattr_block = 0;
+  }
+  if(meta->tail_block && !bitlist_status(meta->tail_block)){
+    meta->tail_block = 0;
+  }
+  if(leaked > 0){
+    fprintf(stderr, "Error: %u blocks marked used, but not referenced\n", leaked);
+    errors++;
+    repaired++;
+  }
+  if(lost > 0){
+    fprintf(stderr, "Error: %u blocks referenced, but marked free\n", lost);
+    errors++;
+    repaired++;
+  }
 
-  entry_debug(&inodes[entry_ptr->inode], 0, name);
+  printf("fsck: %d errors, %d repaired, %.3fs\n", errors, repaired, elapsed(&start));
+
+  free(seen);
+  free(bad);
+  free(expected);
+  blkdev->release();
+  return (errors > repaired) ? -1 : 0;
 }
@@ -6,21 +6,63 @@
 #include <stdlib.h>
 
 #define FSSIZE 10000000
+#ifndef BLKSIZE
 #define BLKSIZE 512
+#endif
 #define NAMESIZE 255
 #define TOTAL_INODES 100
 #define DREFSIZE 100
 
+/* mapfs() backends */
+#define BACKEND_MMAP  0  /* image mapped whole, shared with page cache */
+#define BACKEND_PREAD 1  /* pread/pwrite through our own buffer cache */
+#define BACKEND_URING 2  /* as pread, bulk I/O queued on io_uring */
+
+/* mapfs() hints */
+#define MAP_HINT_POPULATE 1  /* fault in the whole image at once */
+#define MAP_HINT_HUGEPAGE 2  /* back the mapping with huge pages */
+#define MAP_HINT_DIRECT   4  /* O_DIRECT, pread and uring backends only */
+
+/* formatfs() features */
+#define FEATURE_NAME_INDEX  1  /* keep an index of all names */
+#define FEATURE_SORTED_DIRS 2  /* keep directory entries in name order */
+#define FEATURE_TAIL_PACK   4  /* pack small file tails into shared blocks */
+
+/* listfs() formats */
+#define LIST_JSON 0  /* a JSON object per line */
+#define LIST_NUL  1  /* NUL terminated fields */
+#define LIST_PATH 2  /* a path per line */
+
+struct find_query {  /* findfs() predicates */
+  char *       pattern;  /* glob, on the path if it has a '/', else on the name */
+  int          type;     /* 'f', 'd' or 0 for any */
+  int          size_op;  /* '<', '>', '=' or 0 for any */
+  unsigned int size;
+};
+
 extern unsigned char* fs;
 
-void mapfs(int fd);
+void mapfs(int fd, int backend, int hints);
 void unmapfs();
-void formatfs();
-void loadfs();
+void formatfs(int features);
+void loadfs(int recovery);
 void lsfs();
+void listfs(int format, int threads);
+void findfs(const struct find_query * query, int threads);
+void namefs(char* name);
+void dufs(char* path, int threads);
 void addfilefs(char* fname);
+int streamfs(char* path);
+int updatefilefs(char* fname);
 void removefilefs(char* fname);
+void listxattrfs(char* path);
+int getxattrfs(char* path, char* name);
+int setxattrfs(char* path, char* name, char* value);
+void quotafs(char* path, unsigned int bytes, unsigned int count);
 void extractfilefs(char* fname);
+int extracttreefs(char* path, char* dest);
 void debugfs(char * fname);
+int  scrubfs(int threads);
+int  fsckfs(int threads);
 
 #endif